@@ -28,6 +28,7 @@
 
 #define _stringify(s) #s
 #define stringify(s) _stringify(s)
+#define ELEMENTSOF(x) (sizeof(x)/sizeof((x)[0]))
 
 #ifndef EFI_OS_INDICATIONS_BOOT_TO_FW_UI
 #define EFI_OS_INDICATIONS_BOOT_TO_FW_UI 0x0000000000000001ULL
@@ -55,6 +56,34 @@ enum loader_type {
         LOADER_LINUX
 };
 
+enum console_type {
+        CONSOLE_AUTO,
+        CONSOLE_TEXT,
+        CONSOLE_GRAPHICS,
+        CONSOLE_SERIAL,
+};
+
+/*
+ * All configuration data lives as long as the Config it belongs to. It is
+ * carved out of large page allocations and released all at once, instead of
+ * going through the slow firmware pool allocator for every single string.
+ */
+typedef struct ArenaBlock {
+        struct ArenaBlock *next;
+        UINTN pages;
+} ArenaBlock;
+
+typedef struct {
+        ArenaBlock *blocks;
+        UINT8 *pos;
+        UINT8 *end;
+        UINTN block_pages;
+        UINTN block_count;
+        UINTN pages;
+        UINTN alloc_count;
+        UINTN alloc_size;
+} Arena;
+
 typedef struct {
         CHAR16 *file;
         CHAR16 *title_show;
@@ -78,18 +107,69 @@ typedef struct {
         UINTN timeout_sec;
         UINTN timeout_sec_config;
         INTN timeout_sec_efivar;
+        enum console_type console;
+        UINTN read_chunk;
         CHAR16 *entry_default_pattern;
         CHAR16 *options_edit;
         CHAR16 *entries_auto;
+        BOOLEAN entries_auto_loaded;
+        BOOLEAN title_generated;
+        Arena arena;
 } Config;
 
-static CHAR16 *stra_to_str(CHAR8 *stra);
+/*
+ * Images are read into page-aligned memory in large chunks, and handed to
+ * LoadImage() as a buffer, instead of letting the firmware read the file in
+ * whatever block size it picks. The image of the highlighted entry is read
+ * in small steps while the menu waits for a key.
+ */
+typedef struct {
+        const ConfigEntry *entry;
+        EFI_FILE_HANDLE handle;
+        UINT8 *buf;
+        UINTN pages;
+        UINTN size;
+        UINTN pos;
+        UINT64 start_usec;
+        UINT64 end_usec;
+        BOOLEAN failed;
+} ImageReader;
+
+enum timer_source {
+        TIMER_NONE,
+        TIMER_CPUID_CRYSTAL,
+        TIMER_CPUID_BASE,
+        TIMER_ACPI_PM,
+        TIMER_STALL,
+        TIMER_CNTFRQ
+};
+
+static CHAR16 *timer_source_names[] = {
+        [TIMER_NONE] = L"none",
+        [TIMER_CPUID_CRYSTAL] = L"cpuid-0x15",
+        [TIMER_CPUID_BASE] = L"cpuid-0x16",
+        [TIMER_ACPI_PM] = L"acpi-pm",
+        [TIMER_STALL] = L"stall",
+        [TIMER_CNTFRQ] = L"cntfrq",
+};
 
-#ifdef __x86_64__
+/* the clock source behind time_usec(), selected and measured once */
+static struct {
+        enum timer_source source;
+        UINT64 freq;
+} timer;
+
+#if defined(__x86_64__) || defined(__i386__)
 static UINT64 ticks_read(void) {
+#ifdef __x86_64__
         UINT64 a, d;
         __asm__ volatile ("rdtsc" : "=a" (a), "=d" (d));
         return (d << 32) | a;
+#else
+        UINT64 val;
+        __asm__ volatile ("rdtsc" : "=A" (val));
+        return val;
+#endif
 }
 
 static void cpuid_read(UINT32 info, UINT32 *eax, UINT32 *ebx, UINT32 *ecx, UINT32 *edx) {
@@ -104,146 +184,530 @@ static void cpuid_read(UINT32 info, UINT32 *eax, UINT32 *ebx, UINT32 *ecx, UINT3
         );
 }
 
-static UINT64 cpufreq_read(void) {
-        UINT32 eax, ebx, ecx, edx;
-        union {
-                UINT32 i[3][4];
-                CHAR8 s[4 * 4 * 3 + 1];
-        } brand;
-        UINTN i;
-        CHAR8 *s;
-        UINT64 scale;
-        CHAR16 *str;
-        static UINT64 usec;
+static UINT32 port_read32(UINT16 port) {
+        UINT32 v;
+        __asm__ volatile ("inl %w1, %0" : "=a" (v) : "Nd" (port));
+        return v;
+}
+
+/*
+ * Time Stamp Counter and Nominal Core Crystal Clock Information Leaf (0x15),
+ * and Processor Frequency Information Leaf (0x16):
+ *   http://www.intel.com/content/dam/www/public/us/en/documents/manuals/
+ *     64-ia-32-architectures-software-developer-vol-2a-manual.pdf
+ */
+static UINT64 cpuid_freq_read(enum timer_source *source) {
+        UINT32 max, eax, ebx, ecx, edx;
 
-        if (usec > 0)
-                return usec;
+        cpuid_read(0, &max, &ebx, &ecx, &edx);
 
-        for (i = 0; i < 3; i++) {
-                cpuid_read(0x80000002 + i, &eax, &ebx, &ecx, &edx);
-                brand.i[i][0] = eax;
-                brand.i[i][1] = ebx;
-                brand.i[i][2] = ecx;
-                brand.i[i][3] = edx;
+        if (max >= 0x15) {
+                cpuid_read(0x15, &eax, &ebx, &ecx, &edx);
+                if (eax > 0 && ebx > 0 && ecx > 0) {
+                        *source = TIMER_CPUID_CRYSTAL;
+                        return (UINT64)ecx * ebx / eax;
+                }
         }
-        brand.s[4 * 4 * 3] = '\0';
 
-        /*
-         * Extract:
-         *   “x.xxyHz” or “xxxxyHz”, where y=M,G,T
-         * from CPUID brand string:
-         *   Intel(R) Core(TM) i5-2540M CPU @ 2.60GHz
-         *
-         * http://www.intel.com/content/dam/www/public/us/en/documents/
-         *   application-notes/processor-identification-cpuid-instruction-note.pdf
-         */
-        s = NULL;
-        for (i = 4; i < (4 * 4 * 3) - 2; i++) {
-                if (brand.s[i+1] == 'H' && brand.s[i+2] == 'z') {
-                        s = brand.s + i;
+        if (max >= 0x16) {
+                cpuid_read(0x16, &eax, &ebx, &ecx, &edx);
+                if ((eax & 0xffff) > 0) {
+                        *source = TIMER_CPUID_BASE;
+                        return (UINT64)(eax & 0xffff) * 1000 * 1000;
+                }
+        }
+
+        return 0;
+}
+
+struct acpi_rsdp {
+        CHAR8 signature[8];
+        UINT8 checksum;
+        CHAR8 oem_id[6];
+        UINT8 revision;
+        UINT32 rsdt_address;
+        UINT32 length;
+        UINT64 xsdt_address;
+        UINT8 extended_checksum;
+        UINT8 reserved[3];
+} __attribute__((packed));
+
+struct acpi_sdt_header {
+        CHAR8 signature[4];
+        UINT32 length;
+        UINT8 revision;
+        UINT8 checksum;
+        CHAR8 oem_id[6];
+        CHAR8 oem_table_id[8];
+        UINT32 oem_revision;
+        UINT32 creator_id;
+        UINT32 creator_revision;
+} __attribute__((packed));
+
+#define ACPI_PM_TIMER_FREQ              3579545
+#define ACPI_FADT_PM_TMR_BLK            76
+#define ACPI_FADT_FLAGS                 112
+#define ACPI_FADT_FLAGS_TMR_VAL_EXT     (1 << 8)
+#define ACPI_FADT_X_PM_TMR_BLK          208
+
+/* find the I/O port of the ACPI power management timer in the FADT */
+static UINT16 acpi_pm_timer_port(UINT32 *mask) {
+        struct acpi_rsdp *rsdp = NULL;
+        struct acpi_sdt_header *sdt;
+        UINTN entry_size;
+        UINTN i;
+
+        for (i = 0; i < ST->NumberOfTableEntries; i++) {
+                if (CompareGuid(&ST->ConfigurationTable[i].VendorGuid, &Acpi20TableGuid) == 0) {
+                        rsdp = ST->ConfigurationTable[i].VendorTable;
                         break;
                 }
+                if (CompareGuid(&ST->ConfigurationTable[i].VendorGuid, &AcpiTableGuid) == 0)
+                        rsdp = ST->ConfigurationTable[i].VendorTable;
         }
-        if (!s)
+        if (!rsdp)
                 return 0;
 
-        scale = 1000;
-        switch(*s){
-        case 'T':
-                scale *= 1000;
-        case 'G':
-                scale *= 1000;
-        case 'M':
-                scale *= 1000;
-                break;
-        default:
+        if (rsdp->revision >= 2 && rsdp->xsdt_address) {
+                sdt = (struct acpi_sdt_header *)(UINTN)rsdp->xsdt_address;
+                entry_size = sizeof(UINT64);
+        } else {
+                sdt = (struct acpi_sdt_header *)(UINTN)rsdp->rsdt_address;
+                entry_size = sizeof(UINT32);
+        }
+        if (!sdt || sdt->length < sizeof(struct acpi_sdt_header))
+                return 0;
+
+        for (i = 0; i < (sdt->length - sizeof(struct acpi_sdt_header)) / entry_size; i++) {
+                CHAR8 *fadt;
+                UINT64 addr = 0;
+                UINT32 length;
+                UINT32 flags;
+                UINT32 port;
+
+                CopyMem(&addr, (CHAR8 *)(sdt + 1) + i * entry_size, entry_size);
+                fadt = (CHAR8 *)(UINTN)addr;
+                if (!fadt || CompareMem(fadt, "FACP", 4) != 0)
+                        continue;
+
+                length = ((struct acpi_sdt_header *)fadt)->length;
+                if (length < ACPI_FADT_FLAGS + sizeof(UINT32))
+                        return 0;
+
+                CopyMem(&port, fadt + ACPI_FADT_PM_TMR_BLK, sizeof(UINT32));
+                if (port == 0 && length >= ACPI_FADT_X_PM_TMR_BLK + 12) {
+                        /* generic address structure, only system I/O space is supported */
+                        if (fadt[ACPI_FADT_X_PM_TMR_BLK] == 1)
+                                CopyMem(&port, fadt + ACPI_FADT_X_PM_TMR_BLK + 4, sizeof(UINT32));
+                }
+                if (port == 0 || port > 0xffff)
+                        return 0;
+
+                CopyMem(&flags, fadt + ACPI_FADT_FLAGS, sizeof(UINT32));
+                *mask = (flags & ACPI_FADT_FLAGS_TMR_VAL_EXT) ? 0xffffffff : 0xffffff;
+                return port;
+        }
+
+        return 0;
+}
+
+/* count the TSC ticks across one millisecond of the 3.579545 MHz ACPI PM timer */
+static UINT64 acpi_pm_freq_read(void) {
+        UINT16 port;
+        UINT32 mask = 0;
+        UINT32 pm_start, pm_elapsed;
+        UINT64 start, end;
+
+        port = acpi_pm_timer_port(&mask);
+        if (port == 0)
                 return 0;
+
+        /* align to the start of a PM timer tick */
+        pm_start = port_read32(port) & mask;
+        start = ticks_read();
+        while ((port_read32(port) & mask) == pm_start) {
+                /* the timer does not tick; give up after about a second */
+                if (ticks_read() - start > 0xffffffffULL)
+                        return 0;
         }
+        pm_start = port_read32(port) & mask;
+        start = ticks_read();
+
+        do {
+                pm_elapsed = ((port_read32(port) & mask) - pm_start) & mask;
+                end = ticks_read();
+                if (end - start > 0xffffffffULL)
+                        return 0;
+        } while (pm_elapsed < ACPI_PM_TIMER_FREQ / 1000);
+
+        return (end - start) * ACPI_PM_TIMER_FREQ / pm_elapsed;
+}
+
+/* last resort, the firmware's idea of ten milliseconds */
+static UINT64 stall_freq_read(void) {
+        UINT64 start;
+
+        start = ticks_read();
+        uefi_call_wrapper(BS->Stall, 1, 10 * 1000);
+        return (ticks_read() - start) * 100;
+}
 
-        s -= 4;
-        s[4] = '\0';
-        if (s[1] == '.') {
-                s[1] = s[0];
-                s++;
-                scale /= 100;
+static UINT64 timer_freq_read(void) {
+        enum timer_source source = TIMER_NONE;
+        UINT64 freq;
+
+        if (timer.freq > 0)
+                return timer.freq;
+
+        freq = cpuid_freq_read(&source);
+        if (freq == 0) {
+                freq = acpi_pm_freq_read();
+                source = TIMER_ACPI_PM;
         }
+        if (freq == 0) {
+                freq = stall_freq_read();
+                source = TIMER_STALL;
+        }
+        if (freq == 0)
+                source = TIMER_NONE;
+
+        timer.source = source;
+        timer.freq = freq;
+        return freq;
+}
+#elif defined(__aarch64__)
+static UINT64 ticks_read(void) {
+        UINT64 val;
+        __asm__ volatile ("isb; mrs %0, cntvct_el0" : "=r" (val));
+        return val;
+}
+
+static UINT64 timer_freq_read(void) {
+        UINT64 freq;
 
-        str = stra_to_str(s);
-        usec = Atoi(str) * scale;
-        FreePool(str);
-        return usec;
+        if (timer.freq > 0)
+                return timer.freq;
+
+        __asm__ volatile ("mrs %0, cntfrq_el0" : "=r" (freq));
+        timer.source = freq > 0 ? TIMER_CNTFRQ : TIMER_NONE;
+        timer.freq = freq;
+        return freq;
 }
+#else
+static UINT64 ticks_read(void) { return 0; }
+static UINT64 timer_freq_read(void) { return 0; }
+#endif
 
 static UINT64 time_usec(void) {
         UINT64 ticks;
-        UINT64 cpufreq;
+        UINT64 freq;
 
         ticks = ticks_read();
         if (ticks == 0)
                 return 0;
 
-        cpufreq = cpufreq_read();
-        if (cpufreq == 0)
+        freq = timer_freq_read();
+        if (freq == 0)
                 return 0;
 
-        return 1000 * 1000 * ticks / cpufreq;
+        return (ticks / freq) * 1000 * 1000 + (ticks % freq) * 1000 * 1000 / freq;
 }
-#else
-static UINT64 time_usec(void) { return 0; }
-#endif
 
-static EFI_STATUS efivar_set_raw(const EFI_GUID *vendor, CHAR16 *name, CHAR8 *buf, UINTN size, BOOLEAN persistent) {
+/*
+ * Per-phase loader timing, exported as the binary LoaderBootTrace variable;
+ * the event numbers are shared with the setup tool and must not change.
+ */
+enum trace_event {
+        TRACE_NONE,
+        TRACE_CONFIG_READ,      /* \loader\loader.conf; arg: bytes read */
+        TRACE_ENTRY_READ,       /* \loader\entries\*.conf; arg: bytes read */
+        TRACE_CONFIG_LOAD,      /* arg: number of entries */
+        TRACE_AUTO_PROBE,       /* well-known loader lookup; arg: 1 if found */
+        TRACE_AUTO_OSX,         /* arg: number of file systems */
+        TRACE_TITLE_GENERATE,
+        TRACE_DEFAULT_SELECT,   /* arg: selected entry index */
+        TRACE_MENU,
+        TRACE_LOAD_IMAGE,       /* arg: 1 if the image was read during the menu */
+        TRACE_START_IMAGE,
+        TRACE_ENTRIES_INDEX,    /* \loader\entries.idx; arg: 1 if used */
+        TRACE_SORT,             /* arg: number of entries */
+        TRACE_FAST_BOOT,        /* arg: 1 if the selected entry was loaded directly */
+        TRACE_PROBE_CACHE,      /* arg: number of volumes not probed again */
+        TRACE_EFIVAR_FLUSH,     /* arg: number of variables written */
+        TRACE_IMAGE_READ,       /* arg: KiB read before LoadImage */
+        TRACE_IMAGE_PRELOAD,    /* first to last read during the menu; arg: KiB read */
+};
+
+#define TRACE_VERSION 1
+#define TRACE_ENTRIES_MAX 256
+
+typedef struct {
+        UINT64 start_usec;
+        UINT64 end_usec;
+        UINT32 event;
+        UINT32 arg;
+} TraceEntry;
+
+static struct {
+        UINT32 version;
+        UINT32 count;
+        UINT32 dropped;
+        UINT32 reserved;
+        TraceEntry entries[TRACE_ENTRIES_MAX];
+} trace;
+
+/* record an event which started at start_usec and ended at end_usec */
+static VOID trace_add_range(enum trace_event event, UINT64 start_usec, UINT64 end_usec, UINT32 arg) {
+        TraceEntry *t;
+
+        if (start_usec == 0)
+                return;
+
+        if (trace.count == TRACE_ENTRIES_MAX) {
+                trace.dropped++;
+                return;
+        }
+
+        t = &trace.entries[trace.count++];
+        t->start_usec = start_usec;
+        t->end_usec = end_usec;
+        t->event = event;
+        t->arg = arg;
+}
+
+/* record an event which started at start_usec and ends now */
+static VOID trace_add(enum trace_event event, UINT64 start_usec, UINT32 arg) {
+        trace_add_range(event, start_usec, time_usec(), arg);
+}
+
+/*
+ * Every variable is read from the firmware at most once per boot, including
+ * the ones that do not exist. The loader's own writes update the cache;
+ * volatile variables are only marked dirty, and written to the firmware in
+ * one batch by efivar_flush() before an image is started.
+ */
+typedef struct {
+        const EFI_GUID *vendor;
+        CHAR16 *name;
+        CHAR8 *data;
+        UINTN size;
+        BOOLEAN exists;
+        BOOLEAN dirty;
+} EfiVarCache;
+
+static struct {
+        EfiVarCache *vars;
+        UINTN count;
+        UINTN allocated;
+        UINTN reads;
+        UINTN hits;
+        UINTN writes;
+        UINTN nv_writes;
+} efivar_cache;
+
+static EfiVarCache *efivar_cache_find(const EFI_GUID *vendor, CHAR16 *name) {
+        UINTN i;
+
+        for (i = 0; i < efivar_cache.count; i++) {
+                EfiVarCache *v = &efivar_cache.vars[i];
+
+                if (CompareGuid((EFI_GUID *)vendor, (EFI_GUID *)v->vendor) == 0 && StrCmp(name, v->name) == 0)
+                        return v;
+        }
+
+        return NULL;
+}
+
+static EfiVarCache *efivar_cache_add(const EFI_GUID *vendor, CHAR16 *name) {
+        EfiVarCache *v;
+
+        v = efivar_cache_find(vendor, name);
+        if (v) {
+                FreePool(v->data);
+                v->data = NULL;
+                v->size = 0;
+                return v;
+        }
+
+        if (efivar_cache.count == efivar_cache.allocated) {
+                EfiVarCache *vars;
+                UINTN n;
+
+                n = efivar_cache.allocated > 0 ? efivar_cache.allocated * 2 : 32;
+                vars = AllocatePool(n * sizeof(EfiVarCache));
+                if (!vars)
+                        return NULL;
+                if (efivar_cache.count > 0)
+                        CopyMem(vars, efivar_cache.vars, efivar_cache.count * sizeof(EfiVarCache));
+                FreePool(efivar_cache.vars);
+                efivar_cache.vars = vars;
+                efivar_cache.allocated = n;
+        }
+
+        v = &efivar_cache.vars[efivar_cache.count];
+        ZeroMem(v, sizeof(EfiVarCache));
+        v->vendor = vendor;
+        v->name = StrDuplicate(name);
+        if (!v->name)
+                return NULL;
+        efivar_cache.count++;
+        return v;
+}
+
+static VOID efivar_cache_drop(const EFI_GUID *vendor, CHAR16 *name) {
+        EfiVarCache *v;
+
+        v = efivar_cache_find(vendor, name);
+        if (!v)
+                return;
+
+        FreePool(v->name);
+        FreePool(v->data);
+        *v = efivar_cache.vars[--efivar_cache.count];
+}
+
+static EFI_STATUS efivar_write(const EFI_GUID *vendor, CHAR16 *name, CHAR8 *buf, UINTN size, BOOLEAN persistent) {
         UINT32 flags;
 
         flags = EFI_VARIABLE_BOOTSERVICE_ACCESS|EFI_VARIABLE_RUNTIME_ACCESS;
         if (persistent)
                 flags |= EFI_VARIABLE_NON_VOLATILE;
 
+        efivar_cache.writes++;
+        if (persistent)
+                efivar_cache.nv_writes++;
         return uefi_call_wrapper(RT->SetVariable, 5, name, vendor, flags, size, buf);
 }
 
+static EFI_STATUS efivar_set_raw(const EFI_GUID *vendor, CHAR16 *name, CHAR8 *buf, UINTN size, BOOLEAN persistent) {
+        EfiVarCache *v;
+        EFI_STATUS err;
+
+        /* nothing to do if the firmware already has this value */
+        v = efivar_cache_find(vendor, name);
+        if (v && !v->dirty) {
+                if (size == 0 && !v->exists)
+                        return EFI_SUCCESS;
+                if (size > 0 && v->exists && v->size == size && CompareMem(v->data, buf, size) == 0)
+                        return EFI_SUCCESS;
+        }
+
+        if (!persistent) {
+                v = efivar_cache_add(vendor, name);
+                if (v && size > 0)
+                        v->data = AllocatePool(size);
+                if (v && (size == 0 || v->data)) {
+                        if (size > 0)
+                                CopyMem(v->data, buf, size);
+                        v->size = size;
+                        v->exists = size > 0;
+                        v->dirty = TRUE;
+                        return EFI_SUCCESS;
+                }
+
+                /* out of memory, write it directly */
+                efivar_cache_drop(vendor, name);
+        }
+
+        err = efivar_write(vendor, name, buf, size, persistent);
+        if (EFI_ERROR(err)) {
+                /* the state of the variable is unknown now */
+                efivar_cache_drop(vendor, name);
+                return err;
+        }
+
+        v = efivar_cache_add(vendor, name);
+        if (!v)
+                return err;
+        v->exists = size > 0;
+        v->dirty = FALSE;
+        if (size > 0) {
+                v->data = AllocatePool(size);
+                if (!v->data) {
+                        efivar_cache_drop(vendor, name);
+                        return err;
+                }
+                CopyMem(v->data, buf, size);
+                v->size = size;
+        }
+        return err;
+}
+
 static EFI_STATUS efivar_set(CHAR16 *name, CHAR16 *value, BOOLEAN persistent) {
         return efivar_set_raw(&loader_guid, name, (CHAR8 *)value, value ? (StrLen(value)+1) * sizeof(CHAR16) : 0, persistent);
 }
 
 static EFI_STATUS efivar_get_raw(const EFI_GUID *vendor, CHAR16 *name, CHAR8 **buffer, UINTN *size) {
+        EfiVarCache *v;
         CHAR8 *buf;
-        UINTN l;
-        EFI_STATUS err;
 
-        l = sizeof(CHAR16 *) * EFI_MAXIMUM_VARIABLE_SIZE;
-        buf = AllocatePool(l);
+        v = efivar_cache_find(vendor, name);
+        if (v)
+                efivar_cache.hits++;
+        else {
+                CHAR8 small[256];
+                CHAR8 *data = small;
+                UINTN l;
+                EFI_STATUS err;
+
+                /* most variables fit into the small buffer, bigger ones are read again with their size */
+                efivar_cache.reads++;
+                l = sizeof(small);
+                err = uefi_call_wrapper(RT->GetVariable, 5, name, vendor, NULL, &l, small);
+                if (err == EFI_BUFFER_TOO_SMALL) {
+                        data = AllocatePool(l);
+                        if (!data)
+                                return EFI_OUT_OF_RESOURCES;
+                        efivar_cache.reads++;
+                        err = uefi_call_wrapper(RT->GetVariable, 5, name, vendor, NULL, &l, data);
+                }
+
+                /* only remember the answer if it is a definite one */
+                if (err == EFI_SUCCESS || err == EFI_NOT_FOUND)
+                        v = efivar_cache_add(vendor, name);
+                if (v && err == EFI_SUCCESS) {
+                        v->data = AllocatePool(l > 0 ? l : 1);
+                        if (v->data) {
+                                CopyMem(v->data, data, l);
+                                v->size = l;
+                                v->exists = TRUE;
+                        } else {
+                                efivar_cache_drop(vendor, name);
+                                v = NULL;
+                        }
+                }
+                if (data != small)
+                        FreePool(data);
+
+                if (!v)
+                        return EFI_ERROR(err) ? err : EFI_OUT_OF_RESOURCES;
+        }
+
+        if (!v->exists)
+                return EFI_NOT_FOUND;
+
+        /* the callers own the returned copy; one more zero byte terminates strings */
+        buf = AllocatePool(v->size + sizeof(CHAR16));
         if (!buf)
                 return EFI_OUT_OF_RESOURCES;
+        CopyMem(buf, v->data, v->size);
+        ZeroMem(buf + v->size, sizeof(CHAR16));
 
-        err = uefi_call_wrapper(RT->GetVariable, 5, name, vendor, NULL, &l, buf);
-        if (EFI_ERROR(err) == EFI_SUCCESS) {
-                *buffer = buf;
-                if (size)
-                        *size = l;
-        } else
-                FreePool(buf);
-        return err;
-
+        *buffer = buf;
+        if (size)
+                *size = v->size;
+        return EFI_SUCCESS;
 }
 
 static EFI_STATUS efivar_get(CHAR16 *name, CHAR16 **value) {
         CHAR8 *buf;
-        CHAR16 *val;
-        UINTN size;
         EFI_STATUS err;
 
-        err = efivar_get_raw(&loader_guid, name, &buf, &size);
+        err = efivar_get_raw(&loader_guid, name, &buf, NULL);
         if (EFI_ERROR(err) != EFI_SUCCESS)
                 return err;
 
-        val = StrDuplicate((CHAR16 *)buf);
-        if (!val) {
-                FreePool(val);
-                return EFI_OUT_OF_RESOURCES;
-        }
-
-        *value = val;
+        *value = (CHAR16 *)buf;
         return EFI_SUCCESS;
 }
 
@@ -278,183 +742,279 @@ static VOID efivar_set_time_usec(CHAR16 *name, UINT64 usec) {
         efivar_set(name, str, FALSE);
 }
 
-static void cursor_left(UINTN *cursor, UINTN *first)
-{
-        if ((*cursor) > 0)
-                (*cursor)--;
-        else if ((*first) > 0)
-                (*first)--;
+/* write the staged volatile variables, returns the number of variables written */
+static UINTN efivar_flush(VOID) {
+        UINTN i;
+        UINTN n = 0;
+
+        /* the number of flash writes of this boot, for auditing NVRAM wear */
+        efivar_set_int(L"LoaderNVWriteCount", efivar_cache.nv_writes, FALSE);
+
+        for (i = 0; i < efivar_cache.count;) {
+                EfiVarCache *v = &efivar_cache.vars[i];
+                EFI_STATUS err;
+
+                if (!v->dirty) {
+                        i++;
+                        continue;
+                }
+
+                v->dirty = FALSE;
+                err = efivar_write(v->vendor, v->name, v->data, v->size, FALSE);
+                n++;
+
+                /* a failed write leaves the variable in an unknown state, a
+                 * deletion of a variable that never existed is not an error */
+                if (EFI_ERROR(err) && !(err == EFI_NOT_FOUND && !v->exists)) {
+                        efivar_cache_drop(v->vendor, v->name);
+                        continue;
+                }
+                i++;
+        }
+
+        return n;
 }
 
-static void cursor_right(UINTN *cursor, UINTN *first, UINTN x_max, UINTN len)
-{
-        if ((*cursor)+1 < x_max)
-                (*cursor)++;
-        else if ((*first) + (*cursor) < len)
-                (*first)++;
+static VOID trace_export(VOID) {
+        if (trace.count == 0)
+                return;
+
+        trace.version = TRACE_VERSION;
+        efivar_set_raw(&loader_guid, L"LoaderBootTrace", (CHAR8 *)&trace,
+                       (CHAR8 *)&trace.entries[trace.count] - (CHAR8 *)&trace, FALSE);
 }
 
-static BOOLEAN line_edit(CHAR16 *line_in, CHAR16 **line_out, UINTN x_max, UINTN y_pos) {
-        CHAR16 *line;
+/*
+ * The options editor keeps the line in a gap buffer. The gap follows the
+ * position of the last edit, so typing or deleting at the cursor does not
+ * move the rest of the line, and the buffer grows as needed.
+ */
+typedef struct {
+        CHAR16 *buf;
         UINTN size;
-        UINTN len;
-        UINTN first;
+        UINTN gap_start;
+        UINTN gap_end;
+} GapBuffer;
+
+static UINTN gap_len(GapBuffer *gb) {
+        return gb->size - (gb->gap_end - gb->gap_start);
+}
+
+static CHAR16 gap_char(GapBuffer *gb, UINTN i) {
+        if (i >= gap_len(gb))
+                return '\0';
+        if (i < gb->gap_start)
+                return gb->buf[i];
+        return gb->buf[i + gb->gap_end - gb->gap_start];
+}
+
+static BOOLEAN gap_init(GapBuffer *gb, CHAR16 *s) {
+        UINTN len = StrLen(s);
+
+        gb->size = len + 256;
+        gb->buf = AllocatePool(gb->size * sizeof(CHAR16));
+        if (!gb->buf)
+                return FALSE;
+
+        /* the gap starts at the end of the line */
+        CopyMem(gb->buf, s, len * sizeof(CHAR16));
+        gb->gap_start = len;
+        gb->gap_end = gb->size;
+        return TRUE;
+}
+
+static VOID gap_move(GapBuffer *gb, UINTN pos) {
+        while (pos < gb->gap_start)
+                gb->buf[--gb->gap_end] = gb->buf[--gb->gap_start];
+        while (pos > gb->gap_start)
+                gb->buf[gb->gap_start++] = gb->buf[gb->gap_end++];
+}
+
+static BOOLEAN gap_insert(GapBuffer *gb, UINTN pos, CHAR16 c) {
+        if (gb->gap_start == gb->gap_end) {
+                CHAR16 *buf;
+                UINTN size;
+                UINTN tail = gb->size - gb->gap_end;
+
+                size = gb->size * 2;
+                buf = AllocatePool(size * sizeof(CHAR16));
+                if (!buf)
+                        return FALSE;
+                CopyMem(buf, gb->buf, gb->gap_start * sizeof(CHAR16));
+                CopyMem(buf + size - tail, gb->buf + gb->gap_end, tail * sizeof(CHAR16));
+                FreePool(gb->buf);
+                gb->buf = buf;
+                gb->gap_end = size - tail;
+                gb->size = size;
+        }
+
+        gap_move(gb, pos);
+        gb->buf[gb->gap_start++] = c;
+        return TRUE;
+}
+
+static VOID gap_delete(GapBuffer *gb, UINTN pos) {
+        if (pos >= gap_len(gb))
+                return;
+        gap_move(gb, pos);
+        gb->gap_end++;
+}
+
+static CHAR16 *gap_string(GapBuffer *gb) {
+        CHAR16 *s;
+        UINTN tail = gb->size - gb->gap_end;
+
+        s = AllocatePool((gap_len(gb) + 1) * sizeof(CHAR16));
+        if (!s)
+                return NULL;
+        CopyMem(s, gb->buf, gb->gap_start * sizeof(CHAR16));
+        CopyMem(s + gb->gap_start, gb->buf + gb->gap_end, tail * sizeof(CHAR16));
+        s[gap_len(gb)] = '\0';
+        return s;
+}
+
+/* print only the span of the visible line which differs from what is shown */
+static VOID line_edit_draw(GapBuffer *gb, CHAR16 *shown, CHAR16 *print, UINTN first, UINTN x_max, UINTN y_pos) {
+        UINTN start = x_max;
+        UINTN end = 0;
+        UINTN i;
+
+        for (i = 0; i < x_max; i++) {
+                print[i] = gap_char(gb, first + i);
+                if (print[i] == '\0')
+                        print[i] = ' ';
+                if (print[i] == shown[i])
+                        continue;
+                if (start == x_max)
+                        start = i;
+                end = i + 1;
+        }
+        if (start == x_max)
+                return;
+
+        CopyMem(shown + start, print + start, (end - start) * sizeof(CHAR16));
+        print[end] = '\0';
+        uefi_call_wrapper(ST->ConOut->SetCursorPosition, 3, ST->ConOut, start, y_pos);
+        uefi_call_wrapper(ST->ConOut->OutputString, 2, ST->ConOut, print + start);
+}
+
+static BOOLEAN line_edit(CHAR16 *line_in, CHAR16 **line_out, UINTN x_max, UINTN y_pos) {
+        GapBuffer gb;
+        CHAR16 *shown;
         CHAR16 *print;
-        UINTN cursor;
+        UINTN first;
+        UINTN pos;
         BOOLEAN exit;
         BOOLEAN enter;
 
         if (!line_in)
                 line_in = L"";
-        size = StrLen(line_in) + 1024;
-        line = AllocatePool(size * sizeof(CHAR16));
-        StrCpy(line, line_in);
-        len = StrLen(line);
+        if (!gap_init(&gb, line_in))
+                return FALSE;
+        shown = AllocateZeroPool(x_max * sizeof(CHAR16));
         print = AllocatePool((x_max+1) * sizeof(CHAR16));
+        if (!shown || !print) {
+                FreePool(shown);
+                FreePool(print);
+                FreePool(gb.buf);
+                return FALSE;
+        }
 
         uefi_call_wrapper(ST->ConOut->EnableCursor, 2, ST->ConOut, TRUE);
 
         first = 0;
-        cursor = 0;
+        pos = 0;
         enter = FALSE;
         exit = FALSE;
         while (!exit) {
                 UINTN index;
-                EFI_STATUS err;
                 EFI_INPUT_KEY key;
-                UINTN i;
 
-                i = len - first;
-                if (i >= x_max-1)
-                        i = x_max-1;
-                CopyMem(print, line + first, i * sizeof(CHAR16));
-                print[i++] = ' ';
-                print[i] = '\0';
-
-                uefi_call_wrapper(ST->ConOut->SetCursorPosition, 3, ST->ConOut, 0, y_pos);
-                uefi_call_wrapper(ST->ConOut->OutputString, 2, ST->ConOut, print);
-                uefi_call_wrapper(ST->ConOut->SetCursorPosition, 3, ST->ConOut, cursor, y_pos);
+                line_edit_draw(&gb, shown, print, first, x_max, y_pos);
+                uefi_call_wrapper(ST->ConOut->SetCursorPosition, 3, ST->ConOut, pos - first, y_pos);
 
+                /* handle all queued keystrokes, pasted text is drawn once */
                 uefi_call_wrapper(BS->WaitForEvent, 3, 1, &ST->ConIn->WaitForKey, &index);
-                err = uefi_call_wrapper(ST->ConIn->ReadKeyStroke, 2, ST->ConIn, &key);
-                if (EFI_ERROR(err))
-                        continue;
+                while (!exit && uefi_call_wrapper(ST->ConIn->ReadKeyStroke, 2, ST->ConIn, &key) == EFI_SUCCESS) {
+                        UINTN len = gap_len(&gb);
 
-                switch (key.ScanCode) {
-                case SCAN_ESC:
-                        exit = TRUE;
-                        break;
-                case SCAN_HOME:
-                        cursor = 0;
-                        first = 0;
-                        continue;
-                case SCAN_END:
-                        cursor = len;
-                        if (cursor+1 >= x_max) {
-                                cursor = x_max-1;
-                                first = len - (x_max-1);
+                        switch (key.ScanCode) {
+                        case SCAN_ESC:
+                                exit = TRUE;
+                                break;
+                        case SCAN_HOME:
+                                pos = 0;
+                                break;
+                        case SCAN_END:
+                                pos = len;
+                                break;
+                        case SCAN_UP:
+                                /* the start of the previous word */
+                                while (pos > 0 && gap_char(&gb, pos-1) == ' ')
+                                        pos--;
+                                while (pos > 0 && gap_char(&gb, pos-1) != ' ')
+                                        pos--;
+                                break;
+                        case SCAN_DOWN:
+                                /* the start of the next word */
+                                while (pos < len && gap_char(&gb, pos) != ' ')
+                                        pos++;
+                                while (pos < len && gap_char(&gb, pos) == ' ')
+                                        pos++;
+                                break;
+                        case SCAN_RIGHT:
+                                if (pos < len)
+                                        pos++;
+                                break;
+                        case SCAN_LEFT:
+                                if (pos > 0)
+                                        pos--;
+                                break;
+                        case SCAN_DELETE:
+                                gap_delete(&gb, pos);
+                                break;
                         }
-                        continue;
-                case SCAN_UP:
-                        while((first + cursor) && line[first + cursor] == ' ')
-                                cursor_left(&cursor, &first);
-                        while((first + cursor) && line[first + cursor] != ' ')
-                                cursor_left(&cursor, &first);
-                        while((first + cursor) && line[first + cursor] == ' ')
-                                cursor_left(&cursor, &first);
-                        if (first + cursor != len && first + cursor)
-                                cursor_right(&cursor, &first, x_max, len);
-                        uefi_call_wrapper(ST->ConOut->SetCursorPosition, 3, ST->ConOut, cursor, y_pos);
-                        continue;
-                case SCAN_DOWN:
-                        while(line[first + cursor] && line[first + cursor] == ' ')
-                                cursor_right(&cursor, &first, x_max, len);
-                        while(line[first + cursor] && line[first + cursor] != ' ')
-                                cursor_right(&cursor, &first, x_max, len);
-                        while(line[first + cursor] && line[first + cursor] == ' ')
-                                cursor_right(&cursor, &first, x_max, len);
-                        uefi_call_wrapper(ST->ConOut->SetCursorPosition, 3, ST->ConOut, cursor, y_pos);
-                        continue;
-                case SCAN_RIGHT:
-                        if (first + cursor == len)
-                                continue;
-                        cursor_right(&cursor, &first, x_max, len);
-                        uefi_call_wrapper(ST->ConOut->SetCursorPosition, 3, ST->ConOut, cursor, y_pos);
-                        continue;
-                case SCAN_LEFT:
-                        cursor_left(&cursor, &first);
-                        uefi_call_wrapper(ST->ConOut->SetCursorPosition, 3, ST->ConOut, cursor, y_pos);
-                        continue;
-                case SCAN_DELETE:
-                        if (len == 0)
-                                continue;
-                        if (first + cursor == len)
-                                continue;
-                        for (i = first + cursor; i < len; i++)
-                                line[i] = line[i+1];
-                        line[len-1] = ' ';
-                        len--;
-                        continue;
-                }
 
-                switch (key.UnicodeChar) {
-                case CHAR_LINEFEED:
-                case CHAR_CARRIAGE_RETURN:
-                        if (StrCmp(line, line_in) != 0) {
-                                *line_out = line;
-                                line = NULL;
+                        switch (key.UnicodeChar) {
+                        case CHAR_LINEFEED:
+                        case CHAR_CARRIAGE_RETURN: {
+                                CHAR16 *line;
+
+                                line = gap_string(&gb);
+                                if (line && StrCmp(line, line_in) != 0)
+                                        *line_out = line;
+                                else
+                                        FreePool(line);
+                                enter = TRUE;
+                                exit = TRUE;
+                                break;
                         }
-                        enter = TRUE;
-                        exit = TRUE;
-                        break;
-                case CHAR_BACKSPACE:
-                        if (len == 0)
-                                continue;
-                        if (first == 0 && cursor == 0)
-                                continue;
-                        for (i = first + cursor-1; i < len; i++)
-                                line[i] = line[i+1];
-                        len--;
-                        if (cursor > 0)
-                                cursor--;
-                        if (cursor > 0 || first == 0)
-                                continue;
-                        /* show full line if it fits */
-                        if (len < x_max) {
-                                cursor = first;
-                                first = 0;
-                                continue;
+                        case CHAR_BACKSPACE:
+                                if (pos > 0)
+                                        gap_delete(&gb, --pos);
+                                break;
+                        case '\t':
+                        case ' ' ... '~':
+                        case 0x80 ... 0xffff:
+                                if (gap_insert(&gb, pos, key.UnicodeChar))
+                                        pos++;
+                                break;
                         }
-                        /* jump left to see what we delete */
-                        if (first > 10) {
-                                first -= 10;
-                                cursor = 10;
-                        } else {
-                                cursor = first;
+
+                        /* keep the cursor visible, show the full line if it fits */
+                        if (gap_len(&gb) < x_max)
                                 first = 0;
-                        }
-                        continue;
-                case '\t':
-                case ' ' ... '~':
-                case 0x80 ... 0xffff:
-                        if (len+1 == size)
-                                continue;
-                        for (i = len; i > first + cursor; i--)
-                                line[i] = line[i-1];
-                        line[first + cursor] = key.UnicodeChar;
-                        len++;
-                        line[len] = '\0';
-                        if (cursor+1 < x_max)
-                                cursor++;
-                        else if (first + cursor < len)
-                                first++;
-                        continue;
+                        else if (pos < first)
+                                first = pos > 10 ? pos - 10 : 0;
+                        else if (pos - first > x_max-1)
+                                first = pos - (x_max-1);
                 }
         }
 
         uefi_call_wrapper(ST->ConOut->EnableCursor, 2, ST->ConOut, FALSE);
+        FreePool(shown);
         FreePool(print);
-        FreePool(line);
+        FreePool(gb.buf);
         return enter;
 }
 
@@ -473,6 +1033,11 @@ static VOID dump_status(Config *config, CHAR16 *loaded_image_path) {
         Print(L"UEFI version:           %d.%02d\n", ST->Hdr.Revision >> 16, ST->Hdr.Revision & 0xffff);
         Print(L"firmware vendor:        %s\n", ST->FirmwareVendor);
         Print(L"firmware version:       %d.%02d\n", ST->FirmwareRevision >> 16, ST->FirmwareRevision & 0xffff);
+        Print(L"timer source:           %s\n", timer_source_names[timer.source]);
+        Print(L"timer frequency:        %ld Hz\n", timer.freq);
+        Print(L"boot trace events:      %d\n", trace.count);
+        Print(L"EFI variable reads:     %d, %d from cache\n", efivar_cache.reads, efivar_cache.hits);
+        Print(L"EFI variable writes:    %d, %d non-volatile\n", efivar_cache.writes, efivar_cache.nv_writes);
         if (efivar_get_raw(&global_guid, L"SecureBoot", &b, &size) == EFI_SUCCESS) {
                 Print(L"SecureBoot:             %s\n", *b > 0 ? L"enabled" : L"disabled");
                 FreePool(b);
@@ -497,6 +1062,8 @@ static VOID dump_status(Config *config, CHAR16 *loaded_image_path) {
         Print(L"\n");
 
         Print(L"config entry count:     %d\n", config->entry_count);
+        Print(L"config allocations:     %d, %d bytes\n", config->arena.alloc_count, config->arena.alloc_size);
+        Print(L"config memory:          %d pages in %d blocks\n", config->arena.pages, config->arena.block_count);
         Print(L"entry selected idx:     %d\n", config->idx_default);
         if (config->idx_default_efivar >= 0)
                 Print(L"entry EFI var idx:      %d\n", config->idx_default_efivar);
@@ -558,6 +1125,59 @@ static VOID dump_status(Config *config, CHAR16 *loaded_image_path) {
         uefi_call_wrapper(ST->ConOut->ClearScreen, 1, ST->ConOut);
 }
 
+/*
+ * The serial port of the console, from the device paths in the ConOut
+ * variable. With serial_only, only if all console output goes to serial
+ * terminals.
+ */
+static SERIAL_IO_INTERFACE *console_serial_find(BOOLEAN serial_only) {
+        CHAR8 *buf;
+        UINTN size;
+        EFI_DEVICE_PATH *node;
+        EFI_DEVICE_PATH *instance;
+        EFI_DEVICE_PATH *serial_path = NULL;
+        EFI_HANDLE handle;
+        SERIAL_IO_INTERFACE *serial = NULL;
+        BOOLEAN uart = FALSE;
+        BOOLEAN other = FALSE;
+
+        if (efivar_get_raw(&global_guid, L"ConOut", &buf, &size) != EFI_SUCCESS)
+                return NULL;
+
+        instance = (EFI_DEVICE_PATH *)buf;
+        node = instance;
+        while ((CHAR8 *)node + sizeof(EFI_DEVICE_PATH) <= buf + size && (UINTN)DevicePathNodeLength(node) >= sizeof(EFI_DEVICE_PATH)) {
+                if (DevicePathType(node) == MESSAGING_DEVICE_PATH && DevicePathSubType(node) == MSG_UART_DP)
+                        uart = TRUE;
+
+                if (IsDevicePathEndType(node)) {
+                        if (uart && !serial_path)
+                                serial_path = instance;
+                        if (!uart)
+                                other = TRUE;
+                        if (IsDevicePathEnd(node))
+                                break;
+
+                        /* the next instance */
+                        instance = NextDevicePathNode(node);
+                        uart = FALSE;
+                }
+
+                node = NextDevicePathNode(node);
+        }
+
+        if (!serial_path || (serial_only && other))
+                goto out;
+
+        if (uefi_call_wrapper(BS->LocateDevicePath, 3, &SerialIoProtocol, &serial_path, &handle) != EFI_SUCCESS)
+                goto out;
+        if (uefi_call_wrapper(BS->HandleProtocol, 3, handle, &SerialIoProtocol, (VOID **)&serial) != EFI_SUCCESS)
+                serial = NULL;
+out:
+        FreePool(buf);
+        return serial;
+}
+
 static EFI_STATUS console_text_mode(VOID) {
         #define EFI_CONSOLE_CONTROL_PROTOCOL_GUID \
                 { 0xf42f7782, 0x12e, 0x4c12, { 0x99, 0x56, 0x49, 0xf9, 0x43, 0x4, 0xf7, 0x21 }};
@@ -603,25 +1223,1030 @@ static EFI_STATUS console_text_mode(VOID) {
         return uefi_call_wrapper(ConsoleControl->SetMode, 2, ConsoleControl, EfiConsoleControlScreenText);
 }
 
-static BOOLEAN menu_run(Config *config, ConfigEntry **chosen_entry, CHAR16 *loaded_image_path) {
+/*
+ * The menu is drawn into a shadow text grid. Only the cells which differ
+ * from what is on the screen are sent to the console, in runs of the same
+ * attribute. The bottom-right cell is never written, it scrolls the screen
+ * on many consoles.
+ *
+ * With "console graphics" in loader.conf, the grid is rendered with the
+ * built-in font into an off-screen buffer instead, and every frame is sent
+ * to the framebuffer with a single Blt() of the changed area.
+ *
+ * On a serial-only console, or with "console serial", the changes are sent
+ * as VT100 sequences directly to the serial port, bypassing the firmware's
+ * terminal emulation.
+ */
+typedef struct {
+        UINTN x_max;
+        UINTN y_max;
+        CHAR16 *chars;
+        UINT8 *attrs;
+        CHAR16 *chars_shown;
+        UINT8 *attrs_shown;
+        CHAR16 *run;
+        UINTN attr;
+        UINTN cursor_x;
+        UINTN cursor_y;
+        EFI_GRAPHICS_OUTPUT_PROTOCOL *gop;
+        EFI_GRAPHICS_OUTPUT_BLT_PIXEL *pixels;
+        UINTN x_offset;
+        UINTN y_offset;
+        SERIAL_IO_INTERFACE *serial;
+        CHAR8 *out;
+        UINTN out_len;
+} Screen;
+
+#define SCREEN_SERIAL_BUFFER 4096
+
+#define FONT_WIDTH 8
+#define FONT_HEIGHT 16
+
+/*
+ * 5x7 glyphs for ' ' to '~', one byte per line, bit 4 is the leftmost
+ * pixel. They are drawn doubled in height and one pixel bolder.
+ */
+static const UINT8 font_glyphs[95][7] = {
+        { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, /* ' ' */
+        { 0x04, 0x04, 0x04, 0x04, 0x04, 0x00, 0x04 }, /* '!' */
+        { 0x0a, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x00 }, /* '"' */
+        { 0x0a, 0x0a, 0x1f, 0x0a, 0x1f, 0x0a, 0x0a }, /* '#' */
+        { 0x04, 0x0f, 0x14, 0x0e, 0x05, 0x1e, 0x04 }, /* '$' */
+        { 0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03 }, /* '%' */
+        { 0x0c, 0x12, 0x14, 0x08, 0x15, 0x12, 0x0d }, /* '&' */
+        { 0x04, 0x04, 0x08, 0x00, 0x00, 0x00, 0x00 }, /* '\'' */
+        { 0x02, 0x04, 0x08, 0x08, 0x08, 0x04, 0x02 }, /* '(' */
+        { 0x08, 0x04, 0x02, 0x02, 0x02, 0x04, 0x08 }, /* ')' */
+        { 0x00, 0x04, 0x15, 0x0e, 0x15, 0x04, 0x00 }, /* '*' */
+        { 0x00, 0x04, 0x04, 0x1f, 0x04, 0x04, 0x00 }, /* '+' */
+        { 0x00, 0x00, 0x00, 0x00, 0x0c, 0x04, 0x08 }, /* ',' */
+        { 0x00, 0x00, 0x00, 0x1f, 0x00, 0x00, 0x00 }, /* '-' */
+        { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c }, /* '.' */
+        { 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00 }, /* '/' */
+        { 0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e }, /* '0' */
+        { 0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e }, /* '1' */
+        { 0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f }, /* '2' */
+        { 0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e }, /* '3' */
+        { 0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02 }, /* '4' */
+        { 0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e }, /* '5' */
+        { 0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e }, /* '6' */
+        { 0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 }, /* '7' */
+        { 0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e }, /* '8' */
+        { 0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c }, /* '9' */
+        { 0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x0c, 0x00 }, /* ':' */
+        { 0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x04, 0x08 }, /* ';' */
+        { 0x02, 0x04, 0x08, 0x10, 0x08, 0x04, 0x02 }, /* '<' */
+        { 0x00, 0x00, 0x1f, 0x00, 0x1f, 0x00, 0x00 }, /* '=' */
+        { 0x08, 0x04, 0x02, 0x01, 0x02, 0x04, 0x08 }, /* '>' */
+        { 0x0e, 0x11, 0x01, 0x02, 0x04, 0x00, 0x04 }, /* '?' */
+        { 0x0e, 0x11, 0x01, 0x0d, 0x15, 0x15, 0x0e }, /* '@' */
+        { 0x0e, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11 }, /* 'A' */
+        { 0x1e, 0x11, 0x11, 0x1e, 0x11, 0x11, 0x1e }, /* 'B' */
+        { 0x0e, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0e }, /* 'C' */
+        { 0x1c, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1c }, /* 'D' */
+        { 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x1f }, /* 'E' */
+        { 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x10 }, /* 'F' */
+        { 0x0e, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0f }, /* 'G' */
+        { 0x11, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11 }, /* 'H' */
+        { 0x0e, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0e }, /* 'I' */
+        { 0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0c }, /* 'J' */
+        { 0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11 }, /* 'K' */
+        { 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1f }, /* 'L' */
+        { 0x11, 0x1b, 0x15, 0x15, 0x11, 0x11, 0x11 }, /* 'M' */
+        { 0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11 }, /* 'N' */
+        { 0x0e, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e }, /* 'O' */
+        { 0x1e, 0x11, 0x11, 0x1e, 0x10, 0x10, 0x10 }, /* 'P' */
+        { 0x0e, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0d }, /* 'Q' */
+        { 0x1e, 0x11, 0x11, 0x1e, 0x14, 0x12, 0x11 }, /* 'R' */
+        { 0x0f, 0x10, 0x10, 0x0e, 0x01, 0x01, 0x1e }, /* 'S' */
+        { 0x1f, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 }, /* 'T' */
+        { 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e }, /* 'U' */
+        { 0x11, 0x11, 0x11, 0x11, 0x11, 0x0a, 0x04 }, /* 'V' */
+        { 0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0a }, /* 'W' */
+        { 0x11, 0x11, 0x0a, 0x04, 0x0a, 0x11, 0x11 }, /* 'X' */
+        { 0x11, 0x11, 0x0a, 0x04, 0x04, 0x04, 0x04 }, /* 'Y' */
+        { 0x1f, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1f }, /* 'Z' */
+        { 0x0e, 0x08, 0x08, 0x08, 0x08, 0x08, 0x0e }, /* '[' */
+        { 0x00, 0x10, 0x08, 0x04, 0x02, 0x01, 0x00 }, /* '\\' */
+        { 0x0e, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0e }, /* ']' */
+        { 0x04, 0x0a, 0x11, 0x00, 0x00, 0x00, 0x00 }, /* '^' */
+        { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1f }, /* '_' */
+        { 0x08, 0x04, 0x02, 0x00, 0x00, 0x00, 0x00 }, /* '`' */
+        { 0x00, 0x00, 0x0e, 0x01, 0x0f, 0x11, 0x0f }, /* 'a' */
+        { 0x10, 0x10, 0x16, 0x19, 0x11, 0x11, 0x1e }, /* 'b' */
+        { 0x00, 0x00, 0x0e, 0x10, 0x10, 0x11, 0x0e }, /* 'c' */
+        { 0x01, 0x01, 0x0d, 0x13, 0x11, 0x11, 0x0f }, /* 'd' */
+        { 0x00, 0x00, 0x0e, 0x11, 0x1f, 0x10, 0x0e }, /* 'e' */
+        { 0x06, 0x09, 0x08, 0x1c, 0x08, 0x08, 0x08 }, /* 'f' */
+        { 0x00, 0x0f, 0x11, 0x11, 0x0f, 0x01, 0x0e }, /* 'g' */
+        { 0x10, 0x10, 0x16, 0x19, 0x11, 0x11, 0x11 }, /* 'h' */
+        { 0x04, 0x00, 0x0c, 0x04, 0x04, 0x04, 0x0e }, /* 'i' */
+        { 0x02, 0x00, 0x06, 0x02, 0x02, 0x12, 0x0c }, /* 'j' */
+        { 0x10, 0x10, 0x12, 0x14, 0x18, 0x14, 0x12 }, /* 'k' */
+        { 0x0c, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0e }, /* 'l' */
+        { 0x00, 0x00, 0x1a, 0x15, 0x15, 0x11, 0x11 }, /* 'm' */
+        { 0x00, 0x00, 0x16, 0x19, 0x11, 0x11, 0x11 }, /* 'n' */
+        { 0x00, 0x00, 0x0e, 0x11, 0x11, 0x11, 0x0e }, /* 'o' */
+        { 0x00, 0x00, 0x1e, 0x11, 0x1e, 0x10, 0x10 }, /* 'p' */
+        { 0x00, 0x00, 0x0d, 0x13, 0x0f, 0x01, 0x01 }, /* 'q' */
+        { 0x00, 0x00, 0x16, 0x19, 0x10, 0x10, 0x10 }, /* 'r' */
+        { 0x00, 0x00, 0x0e, 0x10, 0x0e, 0x01, 0x1e }, /* 's' */
+        { 0x08, 0x08, 0x1c, 0x08, 0x08, 0x09, 0x06 }, /* 't' */
+        { 0x00, 0x00, 0x11, 0x11, 0x11, 0x13, 0x0d }, /* 'u' */
+        { 0x00, 0x00, 0x11, 0x11, 0x11, 0x0a, 0x04 }, /* 'v' */
+        { 0x00, 0x00, 0x11, 0x11, 0x15, 0x15, 0x0a }, /* 'w' */
+        { 0x00, 0x00, 0x11, 0x0a, 0x04, 0x0a, 0x11 }, /* 'x' */
+        { 0x00, 0x00, 0x11, 0x11, 0x0f, 0x01, 0x0e }, /* 'y' */
+        { 0x00, 0x00, 0x1f, 0x02, 0x04, 0x08, 0x1f }, /* 'z' */
+        { 0x02, 0x04, 0x04, 0x08, 0x04, 0x04, 0x02 }, /* '{' */
+        { 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 }, /* '|' */
+        { 0x08, 0x04, 0x04, 0x02, 0x04, 0x04, 0x08 }, /* '}' */
+        { 0x00, 0x00, 0x08, 0x15, 0x02, 0x00, 0x00 }, /* '~' */
+};
+
+static const UINT8 font_glyph_unknown[7] = { 0x1f, 0x11, 0x11, 0x11, 0x11, 0x11, 0x1f };
+
+/* the EFI text attribute colors */
+static const EFI_GRAPHICS_OUTPUT_BLT_PIXEL screen_colors[16] = {
+        { 0x00, 0x00, 0x00, 0 },        /* EFI_BLACK */
+        { 0x98, 0x00, 0x00, 0 },        /* EFI_BLUE */
+        { 0x00, 0x98, 0x00, 0 },        /* EFI_GREEN */
+        { 0x98, 0x98, 0x00, 0 },        /* EFI_CYAN */
+        { 0x00, 0x00, 0x98, 0 },        /* EFI_RED */
+        { 0x98, 0x00, 0x98, 0 },        /* EFI_MAGENTA */
+        { 0x00, 0x98, 0x98, 0 },        /* EFI_BROWN */
+        { 0x98, 0x98, 0x98, 0 },        /* EFI_LIGHTGRAY */
+        { 0x30, 0x30, 0x30, 0 },        /* EFI_DARKGRAY */
+        { 0xff, 0x00, 0x00, 0 },        /* EFI_LIGHTBLUE */
+        { 0x00, 0xff, 0x00, 0 },        /* EFI_LIGHTGREEN */
+        { 0xff, 0xff, 0x00, 0 },        /* EFI_LIGHTCYAN */
+        { 0x00, 0x00, 0xff, 0 },        /* EFI_LIGHTRED */
+        { 0xff, 0x00, 0xff, 0 },        /* EFI_LIGHTMAGENTA */
+        { 0x00, 0xff, 0xff, 0 },        /* EFI_YELLOW */
+        { 0xff, 0xff, 0xff, 0 },        /* EFI_WHITE */
+};
+
+#define SCREEN_ATTR_DEFAULT (EFI_LIGHTGRAY|EFI_BACKGROUND_BLACK)
+#define SCREEN_ATTR_UNKNOWN 0xff
+#define SCREEN_CURSOR_UNKNOWN ((UINTN)-1)
+
+/* unchanged cells rewritten to avoid moving the cursor */
+#define SCREEN_RUN_GAP 4
+
+static UINTN screen_row_len(Screen *screen, UINTN y) {
+        if (y == screen->y_max-1)
+                return screen->x_max-1;
+        return screen->x_max;
+}
+
+/* rows drawn by someone else, repaint them with the next flush */
+static VOID screen_invalidate(Screen *screen, UINTN y, UINTN count) {
+        UINTN i;
+
+        for (i = y * screen->x_max; i < (y + count) * screen->x_max; i++)
+                screen->attrs_shown[i] = SCREEN_ATTR_UNKNOWN;
+        screen->attr = SCREEN_ATTR_UNKNOWN;
+        screen->cursor_x = SCREEN_CURSOR_UNKNOWN;
+        screen->cursor_y = SCREEN_CURSOR_UNKNOWN;
+}
+
+/* the console was just cleared */
+static VOID screen_reset(Screen *screen) {
+        UINTN i;
+
+        /* the cleared text area does not necessarily cover the framebuffer, paint it all */
+        if (screen->gop) {
+                screen_invalidate(screen, 0, screen->y_max);
+                return;
+        }
+
+        for (i = 0; i < screen->x_max * screen->y_max; i++) {
+                screen->chars_shown[i] = ' ';
+                screen->attrs_shown[i] = SCREEN_ATTR_DEFAULT;
+        }
+        screen->attr = SCREEN_ATTR_UNKNOWN;
+        screen->cursor_x = SCREEN_CURSOR_UNKNOWN;
+        screen->cursor_y = SCREEN_CURSOR_UNKNOWN;
+}
+
+static BOOLEAN screen_init(Screen *screen, UINTN x_max, UINTN y_max,
+                           EFI_GRAPHICS_OUTPUT_PROTOCOL *gop, SERIAL_IO_INTERFACE *serial) {
+        UINTN cells = x_max * y_max;
+
+        ZeroMem(screen, sizeof(Screen));
+        screen->x_max = x_max;
+        screen->y_max = y_max;
+        screen->chars = AllocatePool(cells * sizeof(CHAR16));
+        screen->attrs = AllocatePool(cells);
+        screen->chars_shown = AllocatePool(cells * sizeof(CHAR16));
+        screen->attrs_shown = AllocatePool(cells);
+        screen->run = AllocatePool((x_max+1) * sizeof(CHAR16));
+        if (!screen->chars || !screen->attrs || !screen->chars_shown || !screen->attrs_shown || !screen->run)
+                return FALSE;
+
+        if (gop) {
+                screen->gop = gop;
+                screen->pixels = AllocateZeroPool(x_max * FONT_WIDTH * y_max * FONT_HEIGHT *
+                                                  sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL));
+                if (!screen->pixels)
+                        return FALSE;
+
+                /* center the grid on the screen */
+                screen->x_offset = (gop->Mode->Info->HorizontalResolution - x_max * FONT_WIDTH) / 2;
+                screen->y_offset = (gop->Mode->Info->VerticalResolution - y_max * FONT_HEIGHT) / 2;
+        } else if (serial) {
+                screen->serial = serial;
+                screen->out = AllocatePool(SCREEN_SERIAL_BUFFER);
+                if (!screen->out)
+                        return FALSE;
+        }
+
+        screen_reset(screen);
+        return TRUE;
+}
+
+static VOID screen_free(Screen *screen) {
+        FreePool(screen->chars);
+        FreePool(screen->attrs);
+        FreePool(screen->chars_shown);
+        FreePool(screen->attrs_shown);
+        FreePool(screen->run);
+        FreePool(screen->pixels);
+        FreePool(screen->out);
+}
+
+static VOID screen_fill(Screen *screen, UINTN x, UINTN y, UINTN len, UINTN attr) {
+        UINTN i;
+
+        for (i = x; i < x + len && i < screen->x_max; i++) {
+                screen->chars[y * screen->x_max + i] = ' ';
+                screen->attrs[y * screen->x_max + i] = attr;
+        }
+}
+
+static VOID screen_print(Screen *screen, UINTN x, UINTN y, UINTN attr, CHAR16 *str) {
+        UINTN i;
+
+        for (i = 0; str[i] != '\0' && x + i < screen->x_max; i++) {
+                screen->chars[y * screen->x_max + x + i] = str[i];
+                screen->attrs[y * screen->x_max + x + i] = attr;
+        }
+}
+
+static VOID screen_clear(Screen *screen) {
+        UINTN y;
+
+        for (y = 0; y < screen->y_max; y++)
+                screen_fill(screen, 0, y, screen->x_max, SCREEN_ATTR_DEFAULT);
+}
+
+static BOOLEAN screen_cell_changed(Screen *screen, UINTN i) {
+        return screen->chars[i] != screen->chars_shown[i] || screen->attrs[i] != screen->attrs_shown[i];
+}
+
+static VOID screen_draw_glyph(Screen *screen, UINTN x, UINTN y, CHAR16 c, UINTN attr) {
+        const UINT8 *glyph;
+        EFI_GRAPHICS_OUTPUT_BLT_PIXEL fg, bg;
+        EFI_GRAPHICS_OUTPUT_BLT_PIXEL *p;
+        UINTN stride = screen->x_max * FONT_WIDTH;
+        UINTN row;
+
+        if (c >= ' ' && c <= '~')
+                glyph = font_glyphs[c - ' '];
+        else
+                glyph = font_glyph_unknown;
+        fg = screen_colors[attr & 0x0f];
+        bg = screen_colors[(attr >> 4) & 0x07];
+
+        p = screen->pixels + y * FONT_HEIGHT * stride + x * FONT_WIDTH;
+        for (row = 0; row < FONT_HEIGHT; row++) {
+                UINT8 bits = 0;
+                UINTN col;
+
+                /* one blank line above and below the glyph */
+                if (row >= 1 && row < FONT_HEIGHT-1) {
+                        bits = glyph[(row - 1) / 2] << 2;
+                        bits |= bits >> 1;
+                }
+                for (col = 0; col < FONT_WIDTH; col++)
+                        p[col] = (bits & (0x80 >> col)) ? fg : bg;
+                p += stride;
+        }
+}
+
+/* render the changed cells, and copy the rectangle around them to the framebuffer */
+static VOID screen_flush_graphics(Screen *screen) {
+        UINTN x_min = screen->x_max;
+        UINTN x_end = 0;
+        UINTN y_min = screen->y_max;
+        UINTN y_end = 0;
+        UINTN x, y;
+
+        for (y = 0; y < screen->y_max; y++) {
+                for (x = 0; x < screen->x_max; x++) {
+                        UINTN i = y * screen->x_max + x;
+
+                        if (!screen_cell_changed(screen, i))
+                                continue;
+
+                        screen_draw_glyph(screen, x, y, screen->chars[i], screen->attrs[i]);
+                        screen->chars_shown[i] = screen->chars[i];
+                        screen->attrs_shown[i] = screen->attrs[i];
+
+                        if (x < x_min)
+                                x_min = x;
+                        if (x >= x_end)
+                                x_end = x + 1;
+                        if (y < y_min)
+                                y_min = y;
+                        y_end = y + 1;
+                }
+        }
+
+        if (x_end == 0)
+                return;
+
+        uefi_call_wrapper(screen->gop->Blt, 10, screen->gop, screen->pixels, EfiBltBufferToVideo,
+                          x_min * FONT_WIDTH, y_min * FONT_HEIGHT,
+                          screen->x_offset + x_min * FONT_WIDTH, screen->y_offset + y_min * FONT_HEIGHT,
+                          (x_end - x_min) * FONT_WIDTH, (y_end - y_min) * FONT_HEIGHT,
+                          screen->x_max * FONT_WIDTH * sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL));
+}
+
+static VOID screen_serial_write(Screen *screen) {
+        UINTN len = screen->out_len;
+
+        if (len == 0)
+                return;
+        uefi_call_wrapper(screen->serial->Write, 3, screen->serial, &len, screen->out);
+        screen->out_len = 0;
+}
+
+static VOID screen_serial_put(Screen *screen, CHAR8 *s, UINTN len) {
+        if (screen->out_len + len > SCREEN_SERIAL_BUFFER)
+                screen_serial_write(screen);
+        CopyMem(screen->out + screen->out_len, s, len);
+        screen->out_len += len;
+}
+
+static UINTN screen_serial_number(CHAR8 *s, UINTN n) {
+        CHAR8 digits[20];
+        UINTN len = 0;
+        UINTN i;
+
+        do {
+                digits[len++] = '0' + n % 10;
+                n /= 10;
+        } while (n > 0);
+        for (i = 0; i < len; i++)
+                s[i] = digits[len - 1 - i];
+        return len;
+}
+
+static VOID screen_set_attr(Screen *screen, UINTN attr) {
+        /* the ANSI color numbers of the EFI colors */
+        static const CHAR8 ansi[8] = { '0', '4', '2', '6', '1', '5', '3', '7' };
+        CHAR8 sgr[] = "\033[0;1;30;40m";
+
+        if (!screen->serial) {
+                uefi_call_wrapper(ST->ConOut->SetAttribute, 2, ST->ConOut, attr);
+                return;
+        }
+
+        sgr[7] = ansi[attr & 0x07];
+        sgr[10] = ansi[(attr >> 4) & 0x07];
+        if (attr & 0x08)
+                screen_serial_put(screen, sgr, sizeof(sgr)-1);
+        else {
+                /* leave out the bold attribute */
+                CopyMem(sgr + 4, sgr + 6, sizeof(sgr) - 6);
+                screen_serial_put(screen, sgr, sizeof(sgr)-3);
+        }
+}
+
+static VOID screen_set_cursor(Screen *screen, UINTN x, UINTN y) {
+        CHAR8 cup[32];
+        UINTN len = 0;
+
+        if (!screen->serial) {
+                uefi_call_wrapper(ST->ConOut->SetCursorPosition, 3, ST->ConOut, x, y);
+                return;
+        }
+
+        cup[len++] = '\033';
+        cup[len++] = '[';
+        len += screen_serial_number(cup + len, y + 1);
+        cup[len++] = ';';
+        len += screen_serial_number(cup + len, x + 1);
+        cup[len++] = 'H';
+        screen_serial_put(screen, cup, len);
+}
+
+static VOID screen_output(Screen *screen, CHAR16 *str) {
+        CHAR8 buf[256];
+        UINTN len = 0;
+
+        if (!screen->serial) {
+                uefi_call_wrapper(ST->ConOut->OutputString, 2, ST->ConOut, str);
+                return;
+        }
+
+        for (; *str; str++) {
+                if (len == sizeof(buf)) {
+                        screen_serial_put(screen, buf, len);
+                        len = 0;
+                }
+                buf[len++] = *str >= ' ' && *str <= '~' ? *str : '?';
+        }
+        screen_serial_put(screen, buf, len);
+}
+
+/* send the changed cells to the console */
+static VOID screen_flush(Screen *screen) {
+        UINTN y;
+
+        if (screen->gop) {
+                screen_flush_graphics(screen);
+                return;
+        }
+
+        for (y = 0; y < screen->y_max; y++) {
+                UINTN row = y * screen->x_max;
+                UINTN len = screen_row_len(screen, y);
+                UINTN x = 0;
+
+                while (x < len) {
+                        UINTN attr;
+                        UINTN end;
+                        UINTN i;
+
+                        if (!screen_cell_changed(screen, row + x)) {
+                                x++;
+                                continue;
+                        }
+
+                        /* extend the run over cells of the same attribute, and over short unchanged gaps */
+                        attr = screen->attrs[row + x];
+                        end = x + 1;
+                        for (i = x + 1; i < len && i - end < SCREEN_RUN_GAP; i++) {
+                                if (screen->attrs[row + i] != attr)
+                                        break;
+                                if (screen_cell_changed(screen, row + i))
+                                        end = i + 1;
+                        }
+
+                        for (i = x; i < end; i++) {
+                                screen->run[i - x] = screen->chars[row + i];
+                                screen->chars_shown[row + i] = screen->chars[row + i];
+                                screen->attrs_shown[row + i] = attr;
+                        }
+                        screen->run[end - x] = '\0';
+
+                        if (screen->attr != attr) {
+                                screen_set_attr(screen, attr);
+                                screen->attr = attr;
+                        }
+                        if (screen->cursor_x != x || screen->cursor_y != y)
+                                screen_set_cursor(screen, x, y);
+                        screen_output(screen, screen->run);
+
+                        /* the cursor position after a line wrap depends on the console */
+                        if (end < screen->x_max) {
+                                screen->cursor_x = end;
+                                screen->cursor_y = y;
+                        } else {
+                                screen->cursor_x = SCREEN_CURSOR_UNKNOWN;
+                                screen->cursor_y = SCREEN_CURSOR_UNKNOWN;
+                        }
+                        x = end;
+                }
+        }
+
+        /* one write to the serial port for the whole frame */
+        if (screen->serial)
+                screen_serial_write(screen);
+}
+
+/*
+ * Hand the console back to ConOut. Its terminal driver does not know what was
+ * written to the serial port directly, and skips setting an attribute or a
+ * cursor position it believes to be current already.
+ */
+static VOID screen_release(Screen *screen) {
+        if (!screen->serial)
+                return;
+
+        screen_set_attr(screen, SCREEN_ATTR_DEFAULT);
+        screen_set_cursor(screen, ST->ConOut->Mode->CursorColumn, ST->ConOut->Mode->CursorRow);
+        screen_serial_write(screen);
+        screen->attr = SCREEN_ATTR_UNKNOWN;
+        screen->cursor_x = SCREEN_CURSOR_UNKNOWN;
+        screen->cursor_y = SCREEN_CURSOR_UNKNOWN;
+}
+
+static UINT32 title_hash(CHAR16 *s) {
+        UINT32 h = 2166136261U;
+
+        /* FNV-1a */
+        while (*s) {
+                h ^= *s++;
+                h *= 16777619U;
+        }
+        return h;
+}
+
+/*
+ * The menu shows one row for every group of entries. Older versions of an
+ * entry with the same title and machine-id are collapsed into the row of
+ * the newest one, and can be expanded. Rows are only drawn when visible.
+ */
+typedef struct {
+        UINTN start;
+        UINTN count;
+        UINTN fill;
+        BOOLEAN expanded;
+} MenuGroup;
+
+typedef struct {
+        UINTN member;
+        UINTN group;
+} MenuRow;
+
+typedef struct {
+        UINTN *members;
+        MenuGroup *groups;
+        UINTN group_count;
+        MenuRow *rows;
+        UINTN row_count;
+} MenuList;
+
+static BOOLEAN menu_group_key_equal(ConfigEntry *a, ConfigEntry *b) {
+        if (StrCmp(a->title, b->title) != 0)
+                return FALSE;
+        if (!a->machine_id || !b->machine_id)
+                return a->machine_id == b->machine_id;
+        return StrCmp(a->machine_id, b->machine_id) == 0;
+}
+
+static VOID menu_list_free(MenuList *list) {
+        FreePool(list->members);
+        FreePool(list->groups);
+        FreePool(list->rows);
+}
+
+/* with a search filter, all matching entries are shown, regardless of their group */
+static VOID menu_list_rows(MenuList *list, BOOLEAN *match) {
+        UINTN g;
+        UINTN n = 0;
+
+        for (g = 0; g < list->group_count; g++) {
+                UINTN i;
+
+                for (i = 0; i < list->groups[g].count; i++) {
+                        if (match) {
+                                if (!match[list->members[list->groups[g].start + i]])
+                                        continue;
+                        } else if (i > 0 && !list->groups[g].expanded)
+                                break;
+
+                        list->rows[n].member = list->groups[g].start + i;
+                        list->rows[n].group = g;
+                        n++;
+                }
+        }
+        list->row_count = n;
+}
+
+/* group the entries, in a single pass over a hash table of the titles and machine-ids */
+static BOOLEAN menu_list_build(MenuList *list, Config *config) {
+        UINTN *group_of = NULL;
+        INTN *table = NULL;
+        UINTN size;
+        UINTN i;
+        BOOLEAN ret = FALSE;
+
+        ZeroMem(list, sizeof(MenuList));
+
+        size = 16;
+        while (size < config->entry_count * 2)
+                size *= 2;
+        list->members = AllocatePool(config->entry_count * sizeof(UINTN));
+        list->groups = AllocatePool(config->entry_count * sizeof(MenuGroup));
+        list->rows = AllocatePool(config->entry_count * sizeof(MenuRow));
+        group_of = AllocatePool(config->entry_count * sizeof(UINTN));
+        table = AllocatePool(size * sizeof(INTN));
+        if (!list->members || !list->groups || !list->rows || !group_of || !table)
+                goto out;
+
+        for (i = 0; i < size; i++)
+                table[i] = -1;
+
+        /* groups are in the order of their first entry */
+        for (i = 0; i < config->entry_count; i++) {
+                ConfigEntry *entry = config->entries[i];
+                UINTN g = list->group_count;
+
+                if (entry->title && entry->version) {
+                        UINTN h;
+
+                        h = title_hash(entry->title);
+                        if (entry->machine_id)
+                                h ^= title_hash(entry->machine_id);
+                        h &= size - 1;
+                        for (;;) {
+                                INTN k = table[h];
+
+                                if (k < 0) {
+                                        table[h] = i;
+                                        break;
+                                }
+
+                                if (config->entries[k]->version && menu_group_key_equal(config->entries[k], entry)) {
+                                        g = group_of[k];
+                                        break;
+                                }
+
+                                h = (h + 1) & (size - 1);
+                        }
+                }
+
+                if (g == list->group_count) {
+                        ZeroMem(&list->groups[g], sizeof(MenuGroup));
+                        list->group_count++;
+                }
+                list->groups[g].count++;
+                group_of[i] = g;
+        }
+
+        for (i = 0; i < list->group_count; i++) {
+                list->groups[i].start = i > 0 ? list->groups[i-1].start + list->groups[i-1].count : 0;
+                list->groups[i].fill = list->groups[i].count;
+        }
+
+        /* the entries are sorted by version, the newest one heads the group */
+        for (i = 0; i < config->entry_count; i++) {
+                MenuGroup *group = &list->groups[group_of[i]];
+
+                list->members[group->start + --group->fill] = i;
+        }
+
+        menu_list_rows(list, NULL);
+        ret = TRUE;
+out:
+        FreePool(group_of);
+        FreePool(table);
+        return ret;
+}
+
+/* the row of an entry, its group is expanded if needed */
+static UINTN menu_list_find_row(MenuList *list, UINTN entry) {
+        UINTN i;
+
+        for (i = 0; i < list->row_count; i++) {
+                MenuGroup *group = &list->groups[list->rows[i].group];
+                UINTN k;
+
+                if (list->members[list->rows[i].member] == entry)
+                        return i;
+                if (group->expanded || list->rows[i].member != group->start)
+                        continue;
+
+                for (k = 1; k < group->count; k++) {
+                        if (list->members[group->start + k] != entry)
+                                continue;
+                        group->expanded = TRUE;
+                        menu_list_rows(list, NULL);
+                        return i + k;
+                }
+        }
+
+        return 0;
+}
+
+/*
+ * Incremental search in the menu. Every word start in the title, version,
+ * machine-id and file name of an entry is indexed with the rest of the
+ * string, sorted case-insensitively, so the entries matching a typed prefix
+ * are a single range found by binary search.
+ */
+typedef struct {
+        CHAR16 *str;
+        UINTN entry;
+} SearchToken;
+
+typedef struct {
+        SearchToken *tokens;
+        UINTN token_count;
+        BOOLEAN *match;
+        CHAR16 query[64];
+        UINTN len;
+} MenuSearch;
+
+static CHAR16 char_lower(CHAR16 c) {
+        if (c >= 'A' && c <= 'Z')
+                return c - 'A' + 'a';
+        return c;
+}
+
+static BOOLEAN search_is_separator(CHAR16 c) {
+        switch (c) {
+        case ' ': case '-': case '_': case '.': case ',': case ':':
+        case '(': case ')': case '[': case ']': case '/': case '\\':
+                return TRUE;
+        }
+        return FALSE;
+}
+
+/* compare at most len characters, ignoring case */
+static INTN search_strncmp(CHAR16 *a, CHAR16 *b, UINTN len) {
+        UINTN i;
+
+        for (i = 0; i < len; i++) {
+                CHAR16 ca = char_lower(a[i]);
+                CHAR16 cb = char_lower(b[i]);
+
+                if (ca != cb)
+                        return ca < cb ? -1 : 1;
+                if (ca == '\0')
+                        break;
+        }
+        return 0;
+}
+
+static UINTN search_add_tokens(SearchToken *tokens, CHAR16 *s, UINTN entry) {
+        UINTN n = 0;
+        UINTN i;
+
+        if (!s)
+                return 0;
+
+        for (i = 0; s[i] != '\0'; i++) {
+                if (search_is_separator(s[i]))
+                        continue;
+                if (i > 0 && !search_is_separator(s[i-1]))
+                        continue;
+                if (tokens) {
+                        tokens[n].str = s + i;
+                        tokens[n].entry = entry;
+                }
+                n++;
+        }
+        return n;
+}
+
+static VOID menu_search_free(MenuSearch *search) {
+        FreePool(search->tokens);
+        FreePool(search->match);
+        ZeroMem(search, sizeof(MenuSearch));
+}
+
+/* build the index when the search is used for the first time */
+static BOOLEAN menu_search_init(MenuSearch *search, Config *config) {
+        SearchToken *tmp, *src, *dst;
+        UINTN width;
+        UINTN n = 0;
+        UINTN i;
+
+        if (search->tokens)
+                return TRUE;
+
+        for (i = 0; i < config->entry_count; i++) {
+                ConfigEntry *entry = config->entries[i];
+
+                n += search_add_tokens(NULL, entry->title_show, i);
+                n += search_add_tokens(NULL, entry->version, i);
+                n += search_add_tokens(NULL, entry->machine_id, i);
+                n += search_add_tokens(NULL, entry->file, i);
+        }
+
+        search->tokens = AllocatePool((n > 0 ? n : 1) * sizeof(SearchToken));
+        search->match = AllocatePool(config->entry_count * sizeof(BOOLEAN));
+        tmp = AllocatePool((n > 0 ? n : 1) * sizeof(SearchToken));
+        if (!search->tokens || !search->match || !tmp) {
+                FreePool(tmp);
+                menu_search_free(search);
+                return FALSE;
+        }
+
+        n = 0;
+        for (i = 0; i < config->entry_count; i++) {
+                ConfigEntry *entry = config->entries[i];
+
+                n += search_add_tokens(search->tokens + n, entry->title_show, i);
+                n += search_add_tokens(search->tokens + n, entry->version, i);
+                n += search_add_tokens(search->tokens + n, entry->machine_id, i);
+                n += search_add_tokens(search->tokens + n, entry->file, i);
+        }
+        search->token_count = n;
+
+        /* bottom-up merge sort */
+        src = search->tokens;
+        dst = tmp;
+        for (width = 1; width < n; width *= 2) {
+                SearchToken *t;
+
+                for (i = 0; i < n; i += 2 * width) {
+                        UINTN l = i;
+                        UINTN mid = i + width < n ? i + width : n;
+                        UINTN r = mid;
+                        UINTN end = i + 2 * width < n ? i + 2 * width : n;
+                        UINTN k = i;
+
+                        while (l < mid && r < end) {
+                                if (search_strncmp(src[r].str, src[l].str, (UINTN)-1) < 0)
+                                        dst[k++] = src[r++];
+                                else
+                                        dst[k++] = src[l++];
+                        }
+                        while (l < mid)
+                                dst[k++] = src[l++];
+                        while (r < end)
+                                dst[k++] = src[r++];
+                }
+
+                t = src;
+                src = dst;
+                dst = t;
+        }
+
+        if (src != search->tokens) {
+                FreePool(search->tokens);
+                search->tokens = src;
+        } else
+                FreePool(tmp);
+
+        return TRUE;
+}
+
+/* mark the entries matching the query, returns the number of matches */
+static UINTN menu_search_match(MenuSearch *search, UINTN entry_count, CHAR16 *query, UINTN len) {
+        UINTN lo, hi;
+        UINTN first;
+        UINTN n = 0;
+        UINTN i;
+
+        /* the first token not sorted before the query */
+        lo = 0;
+        hi = search->token_count;
+        while (lo < hi) {
+                UINTN mid = lo + (hi - lo) / 2;
+
+                if (search_strncmp(search->tokens[mid].str, query, len) < 0)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        first = lo;
+
+        /* the first token sorted after all tokens starting with the query */
+        hi = search->token_count;
+        while (lo < hi) {
+                UINTN mid = lo + (hi - lo) / 2;
+
+                if (search_strncmp(search->tokens[mid].str, query, len) <= 0)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+
+        ZeroMem(search->match, entry_count * sizeof(BOOLEAN));
+        for (i = first; i < lo; i++) {
+                if (search->match[search->tokens[i].entry])
+                        continue;
+                search->match[search->tokens[i].entry] = TRUE;
+                n++;
+        }
+
+        return n;
+}
+
+#define IMAGE_READ_CHUNK (4 * 1024 * 1024)
+
+/* the menu reads in small steps, a key press is handled after at most one of them */
+#define IMAGE_PRELOAD_CHUNK (256 * 1024)
+
+static VOID image_reader_drop(ImageReader *reader) {
+        if (reader->handle)
+                uefi_call_wrapper(reader->handle->Close, 1, reader->handle);
+        if (reader->buf)
+                uefi_call_wrapper(BS->FreePages, 2, (EFI_PHYSICAL_ADDRESS)(UINTN)reader->buf, reader->pages);
+        ZeroMem(reader, sizeof(ImageReader));
+}
+
+/* start over with a different entry, the file is opened by the next image_reader_step() */
+static VOID image_reader_select(ImageReader *reader, const ConfigEntry *entry) {
+        if (reader->entry == entry)
+                return;
+
+        image_reader_drop(reader);
+        if (entry && entry->loader && !entry->call)
+                reader->entry = entry;
+}
+
+static BOOLEAN image_reader_pending(const ImageReader *reader) {
+        if (!reader->entry || reader->failed)
+                return FALSE;
+        return !reader->buf || reader->pos < reader->size;
+}
+
+/* read the next chunk of the selected image */
+static VOID image_reader_step(ImageReader *reader, UINTN chunk) {
+        UINTN len;
+        UINT64 usec;
         EFI_STATUS err;
+
+        if (!image_reader_pending(reader))
+                return;
+
+        if (!reader->buf) {
+                EFI_FILE *root;
+                EFI_FILE_INFO *info;
+                EFI_PHYSICAL_ADDRESS addr;
+
+                root = LibOpenRoot(reader->entry->device);
+                if (!root) {
+                        reader->failed = TRUE;
+                        return;
+                }
+                err = uefi_call_wrapper(root->Open, 5, root, &reader->handle, reader->entry->loader, EFI_FILE_MODE_READ, 0);
+                uefi_call_wrapper(root->Close, 1, root);
+                if (EFI_ERROR(err)) {
+                        reader->handle = NULL;
+                        reader->failed = TRUE;
+                        return;
+                }
+
+                info = LibFileInfo(reader->handle);
+                if (info) {
+                        reader->size = info->FileSize;
+                        FreePool(info);
+                }
+                if (reader->size == 0) {
+                        reader->failed = TRUE;
+                        goto out_close;
+                }
+
+                reader->pages = EFI_SIZE_TO_PAGES(reader->size);
+                err = uefi_call_wrapper(BS->AllocatePages, 4, AllocateAnyPages, EfiLoaderData, reader->pages, &addr);
+                if (EFI_ERROR(err)) {
+                        reader->failed = TRUE;
+                        goto out_close;
+                }
+                reader->buf = (UINT8 *)(UINTN)addr;
+                reader->pos = 0;
+                return;
+        }
+
+        len = reader->size - reader->pos;
+        if (len > chunk)
+                len = chunk;
+        usec = time_usec();
+        err = uefi_call_wrapper(reader->handle->Read, 3, reader->handle, &len, reader->buf + reader->pos);
+        if (reader->start_usec == 0)
+                reader->start_usec = usec;
+        reader->end_usec = time_usec();
+        if (EFI_ERROR(err) || len == 0) {
+                uefi_call_wrapper(BS->FreePages, 2, (EFI_PHYSICAL_ADDRESS)(UINTN)reader->buf, reader->pages);
+                reader->buf = NULL;
+                reader->failed = TRUE;
+                goto out_close;
+        }
+        reader->pos += len;
+        if (reader->pos < reader->size)
+                return;
+
+out_close:
+        uefi_call_wrapper(reader->handle->Close, 1, reader->handle);
+        reader->handle = NULL;
+}
+
+static BOOLEAN menu_run(Config *config, ConfigEntry **chosen_entry, CHAR16 *loaded_image_path, ImageReader *reader) {
+        EFI_STATUS err;
+        MenuList list;
+        MenuSearch search;
+        BOOLEAN searching = FALSE;
+        BOOLEAN filtered = FALSE;
         UINTN visible_max;
         UINTN idx_highlight;
-        UINTN idx_highlight_prev;
         UINTN idx_first;
         UINTN idx_last;
-        BOOLEAN refresh;
-        BOOLEAN highlight;
         UINTN i;
         UINTN line_width;
-        CHAR16 **lines;
         UINTN x_start;
         UINTN y_start;
         UINTN x_max;
         UINTN y_max;
+        UINTN text_x_max;
+        UINTN text_y_max;
+        Screen screen;
+        EFI_GRAPHICS_OUTPUT_PROTOCOL *gop = NULL;
+        SERIAL_IO_INTERFACE *serial = NULL;
         CHAR16 *status;
-        CHAR16 *clearline;
+        EFI_EVENT timer_event = NULL;
+        EFI_EVENT preload_event = NULL;
         INTN timeout_remain;
+        INTN idx_default_efivar;
+        INTN timeout_sec_efivar;
         BOOLEAN exit = FALSE;
         BOOLEAN run = TRUE;
 
@@ -637,27 +2262,89 @@ static BOOLEAN menu_run(Config *config, ConfigEntry **chosen_entry, CHAR16 *load
                 y_max = 25;
         }
 
-        /* we check 10 times per second for a keystroke */
-        if (config->timeout_sec > 0)
-                timeout_remain = config->timeout_sec * 10;
-        else
+        text_x_max = x_max;
+        text_y_max = y_max;
+
+        /* draw into the framebuffer, if configured and there is one */
+        if (config->console == CONSOLE_GRAPHICS &&
+            LibLocateProtocol(&GraphicsOutputProtocol, (VOID **)&gop) == EFI_SUCCESS &&
+            gop->Mode->Info->HorizontalResolution >= 80 * FONT_WIDTH &&
+            gop->Mode->Info->VerticalResolution >= 25 * FONT_HEIGHT) {
+                x_max = gop->Mode->Info->HorizontalResolution / FONT_WIDTH;
+                y_max = gop->Mode->Info->VerticalResolution / FONT_HEIGHT;
+        } else
+                gop = NULL;
+
+        /* write VT100 sequences to the serial port, if configured or if the console is a serial terminal only */
+        if (!gop && config->console == CONSOLE_SERIAL)
+                serial = console_serial_find(FALSE);
+        else if (!gop && config->console == CONSOLE_AUTO)
+                serial = console_serial_find(TRUE);
+
+        if (!screen_init(&screen, x_max, y_max, gop, serial)) {
+                screen_free(&screen);
+                x_max = text_x_max;
+                y_max = text_y_max;
+                if ((!gop && !serial) || !screen_init(&screen, x_max, y_max, NULL, NULL)) {
+                        screen_free(&screen);
+                        *chosen_entry = config->entries[config->idx_default];
+                        return TRUE;
+                }
+        }
+
+        if (!menu_list_build(&list, config)) {
+                menu_list_free(&list);
+                screen_free(&screen);
+                *chosen_entry = config->entries[config->idx_default];
+                return TRUE;
+        }
+        ZeroMem(&search, sizeof(MenuSearch));
+
+        status = NULL;
+
+        /* count down the seconds with a periodic timer event, and wait for a key or the timer */
+        if (config->timeout_sec > 0) {
+                timeout_remain = config->timeout_sec;
+                status = PoolPrint(L"Boot in %d sec.", timeout_remain);
+                err = uefi_call_wrapper(BS->CreateEvent, 5, EVT_TIMER, 0, NULL, NULL, &timer_event);
+                if (!EFI_ERROR(err)) {
+                        err = uefi_call_wrapper(BS->SetTimer, 3, timer_event, TimerPeriodic, 10 * 1000 * 1000);
+                        if (EFI_ERROR(err)) {
+                                uefi_call_wrapper(BS->CloseEvent, 1, timer_event);
+                                timer_event = NULL;
+                        }
+                } else
+                        timer_event = NULL;
+        } else
                 timeout_remain = -1;
 
-        idx_highlight = config->idx_default;
-        idx_highlight_prev = 0;
+        idx_highlight = menu_list_find_row(&list, config->idx_default);
+
+        /* read the image of the highlighted entry in small steps, while waiting for a key */
+        image_reader_select(reader, config->entries[config->idx_default]);
+        err = uefi_call_wrapper(BS->CreateEvent, 5, EVT_TIMER, 0, NULL, NULL, &preload_event);
+        if (!EFI_ERROR(err)) {
+                err = uefi_call_wrapper(BS->SetTimer, 3, preload_event, TimerPeriodic, 10 * 1000);
+                if (EFI_ERROR(err)) {
+                        uefi_call_wrapper(BS->CloseEvent, 1, preload_event);
+                        preload_event = NULL;
+                }
+        } else
+                preload_event = NULL;
+
+        /* changes to the persistent variables are written once when the menu exits */
+        idx_default_efivar = config->idx_default_efivar;
+        timeout_sec_efivar = config->timeout_sec_efivar;
 
         visible_max = y_max - 2;
 
-        if (config->idx_default >= visible_max)
-                idx_first = config->idx_default-1;
+        if (idx_highlight >= visible_max)
+                idx_first = idx_highlight-1;
         else
                 idx_first = 0;
 
         idx_last = idx_first + visible_max-1;
 
-        refresh = TRUE;
-        highlight = FALSE;
-
         /* length of the longest entry */
         line_width = 5;
         for (i = 0; i < config->entry_count; i++) {
@@ -670,79 +2357,65 @@ static BOOLEAN menu_run(Config *config, ConfigEntry **chosen_entry, CHAR16 *load
         if (line_width > x_max-6)
                 line_width = x_max-6;
 
-        /* offsets to center the entries on the screen */
+        /* offset to center the entries on the screen */
         x_start = (x_max - (line_width)) / 2;
-        if (config->entry_count < visible_max)
-                y_start = ((visible_max - config->entry_count) / 2) + 1;
-        else
-                y_start = 0;
-
-        /* menu entries title lines */
-        lines = AllocatePool(sizeof(CHAR16 *) * config->entry_count);
-        for (i = 0; i < config->entry_count; i++) {
-                UINTN j, k;
-
-                lines[i] = AllocatePool(((x_max+1) * sizeof(CHAR16)));
-                for (j = 0; j < x_start; j++)
-                        lines[i][j] = ' ';
-
-                for (k = 0; config->entries[i]->title_show[k] != '\0' && j < x_max; j++, k++)
-                        lines[i][j] = config->entries[i]->title_show[k];
-
-                for (; j < x_max; j++)
-                        lines[i][j] = ' ';
-                lines[i][x_max] = '\0';
-        }
-
-        status = NULL;
-        clearline = AllocatePool((x_max+1) * sizeof(CHAR16));
-        for (i = 0; i < x_max; i++)
-                clearline[i] = ' ';
-        clearline[i] = 0;
 
         while (!exit) {
                 EFI_INPUT_KEY key;
 
-                if (refresh) {
-                        for (i = 0; i < config->entry_count; i++) {
-                                if (i < idx_first || i > idx_last)
-                                        continue;
-                                uefi_call_wrapper(ST->ConOut->SetCursorPosition, 3, ST->ConOut, 0, y_start + i - idx_first);
-                                if (i == idx_highlight)
-                                        uefi_call_wrapper(ST->ConOut->SetAttribute, 2, ST->ConOut,
-                                                          EFI_BLACK|EFI_BACKGROUND_LIGHTGRAY);
-                                else
-                                        uefi_call_wrapper(ST->ConOut->SetAttribute, 2, ST->ConOut,
-                                                          EFI_LIGHTGRAY|EFI_BACKGROUND_BLACK);
-                                uefi_call_wrapper(ST->ConOut->OutputString, 2, ST->ConOut, lines[i]);
-                                if ((INTN)i == config->idx_default_efivar) {
-                                        uefi_call_wrapper(ST->ConOut->SetCursorPosition, 3, ST->ConOut, x_start-3, y_start + i - idx_first);
-                                        uefi_call_wrapper(ST->ConOut->OutputString, 2, ST->ConOut, L"=>");
-                                }
-                        }
-                        refresh = FALSE;
-                } else if (highlight) {
-                        uefi_call_wrapper(ST->ConOut->SetCursorPosition, 3, ST->ConOut, 0, y_start + idx_highlight_prev - idx_first);
-                        uefi_call_wrapper(ST->ConOut->SetAttribute, 2, ST->ConOut, EFI_LIGHTGRAY|EFI_BACKGROUND_BLACK);
-                        uefi_call_wrapper(ST->ConOut->OutputString, 2, ST->ConOut, lines[idx_highlight_prev]);
-                        if ((INTN)idx_highlight_prev == config->idx_default_efivar) {
-                                uefi_call_wrapper(ST->ConOut->SetCursorPosition, 3, ST->ConOut, x_start-3, y_start + idx_highlight_prev - idx_first);
-                                uefi_call_wrapper(ST->ConOut->OutputString, 2, ST->ConOut, L"=>");
-                        }
+                /* the list shrinks with a search or a collapsed group, do not leave rows above the window */
+                if (list.row_count <= visible_max)
+                        idx_first = 0;
+                else if (idx_first > list.row_count - visible_max)
+                        idx_first = list.row_count - visible_max;
+                idx_last = idx_first + visible_max-1;
 
-                        uefi_call_wrapper(ST->ConOut->SetCursorPosition, 3, ST->ConOut, 0, y_start + idx_highlight - idx_first);
-                        uefi_call_wrapper(ST->ConOut->SetAttribute, 2, ST->ConOut, EFI_BLACK|EFI_BACKGROUND_LIGHTGRAY);
-                        uefi_call_wrapper(ST->ConOut->OutputString, 2, ST->ConOut, lines[idx_highlight]);
-                        if ((INTN)idx_highlight == config->idx_default_efivar) {
-                                uefi_call_wrapper(ST->ConOut->SetCursorPosition, 3, ST->ConOut, x_start-3, y_start + idx_highlight - idx_first);
-                                uefi_call_wrapper(ST->ConOut->OutputString, 2, ST->ConOut, L"=>");
+                if (list.row_count < visible_max)
+                        y_start = ((visible_max - list.row_count) / 2) + 1;
+                else
+                        y_start = 0;
+
+                /* draw the frame, and send only what changed to the console */
+                screen_clear(&screen);
+                for (i = idx_first; i <= idx_last && i < list.row_count; i++) {
+                        MenuGroup *group = &list.groups[list.rows[i].group];
+                        UINTN entry = list.members[list.rows[i].member];
+                        UINTN y = y_start + i - idx_first;
+                        UINTN attr;
+
+                        if (i == idx_highlight)
+                                attr = EFI_BLACK|EFI_BACKGROUND_LIGHTGRAY;
+                        else
+                                attr = EFI_LIGHTGRAY|EFI_BACKGROUND_BLACK;
+                        screen_fill(&screen, 0, y, x_max, attr);
+
+                        if (filtered)
+                                screen_print(&screen, x_start, y, attr, config->entries[entry]->title_show);
+                        else if (list.rows[i].member == group->start) {
+                                screen_print(&screen, x_start, y, attr, config->entries[entry]->title_show);
+                                if (group->count > 1) {
+                                        CHAR16 more[32];
+                                        UINTN len;
+
+                                        /* the number of older versions */
+                                        len = StrLen(config->entries[entry]->title_show);
+                                        SPrint(more, sizeof(more), group->expanded ? L" [-]" : L" [+%d]", group->count - 1);
+                                        screen_print(&screen, x_start + len, y, attr, more);
+                                }
+                        } else
+                                screen_print(&screen, x_start + 2, y, attr, config->entries[entry]->title_show);
+
+                        if ((INTN)entry == config->idx_default_efivar)
+                                screen_print(&screen, x_start-3, y, attr, L"=>");
+                        else if (!filtered && !group->expanded && list.rows[i].member == group->start &&
+                                 config->idx_default_efivar >= 0) {
+                                UINTN k;
+
+                                /* the default entry is collapsed into this row */
+                                for (k = 1; k < group->count; k++)
+                                        if ((INTN)list.members[group->start + k] == config->idx_default_efivar)
+                                                screen_print(&screen, x_start-3, y, attr, L"=>");
                         }
-                        highlight = FALSE;
-                }
-
-                if (timeout_remain > 0) {
-                        FreePool(status);
-                        status = PoolPrint(L"Boot in %d sec.", (timeout_remain + 5) / 10);
                 }
 
                 /* print status at last line of screen */
@@ -756,209 +2429,394 @@ static BOOLEAN menu_run(Config *config, ConfigEntry **chosen_entry, CHAR16 *load
                                 x = (x_max - len) / 2;
                         else
                                 x = 0;
-                        uefi_call_wrapper(ST->ConOut->SetAttribute, 2, ST->ConOut, EFI_LIGHTGRAY|EFI_BACKGROUND_BLACK);
-                        uefi_call_wrapper(ST->ConOut->SetCursorPosition, 3, ST->ConOut, 0, y_max-1);
-                        uefi_call_wrapper(ST->ConOut->OutputString, 2, ST->ConOut, clearline + (x_max - x));
-                        uefi_call_wrapper(ST->ConOut->OutputString, 2, ST->ConOut, status);
-                        uefi_call_wrapper(ST->ConOut->OutputString, 2, ST->ConOut, clearline+1 + x + len);
+                        screen_print(&screen, x, y_max-1, EFI_LIGHTGRAY|EFI_BACKGROUND_BLACK, status);
                 }
+                screen_flush(&screen);
 
                 err = uefi_call_wrapper(ST->ConIn->ReadKeyStroke, 2, ST->ConIn, &key);
                 if (err == EFI_NOT_READY) {
+                        EFI_EVENT events[3];
+                        UINTN n = 0;
                         UINTN index;
+                        UINTN index_countdown = ELEMENTSOF(events);
+                        UINTN index_preload = ELEMENTSOF(events);
 
                         if (timeout_remain == 0) {
                                 exit = TRUE;
                                 break;
                         }
-                        if (timeout_remain > 0) {
-                                uefi_call_wrapper(BS->Stall, 1, 100 * 1000);
-                                timeout_remain--;
-                                continue;
+
+                        events[n++] = ST->ConIn->WaitForKey;
+                        if (timeout_remain > 0 && timer_event) {
+                                index_countdown = n;
+                                events[n++] = timer_event;
                         }
-                        uefi_call_wrapper(BS->WaitForEvent, 3, 1, &ST->ConIn->WaitForKey, &index);
+                        if (preload_event && image_reader_pending(reader)) {
+                                index_preload = n;
+                                events[n++] = preload_event;
+                        }
+
+                        if (timeout_remain > 0 && !timer_event) {
+                                /* no timer event available, count the seconds with Stall() */
+                                uefi_call_wrapper(BS->Stall, 1, 1000 * 1000);
+                                index = index_countdown = 1;
+                        } else
+                                uefi_call_wrapper(BS->WaitForEvent, 3, n, events, &index);
+
+                        /* the status line changes only when the displayed second does */
+                        if (index == index_countdown) {
+                                timeout_remain--;
+                                FreePool(status);
+                                status = PoolPrint(L"Boot in %d sec.", timeout_remain);
+                        } else if (index == index_preload)
+                                image_reader_step(reader, IMAGE_PRELOAD_CHUNK);
                         continue;
                 }
+
+                /* a keystroke stops the countdown */
+                if (timeout_remain >= 0 && timer_event)
+                        uefi_call_wrapper(BS->SetTimer, 3, timer_event, TimerCancel, 0);
                 timeout_remain = -1;
 
-                /* clear status after keystroke */
-                if (status) {
+                /* handle all queued keystrokes before the screen is drawn again */
+                do {
+                        /* clear status after keystroke */
                         FreePool(status);
                         status = NULL;
-                        uefi_call_wrapper(ST->ConOut->SetAttribute, 2, ST->ConOut, EFI_LIGHTGRAY|EFI_BACKGROUND_BLACK);
-                        uefi_call_wrapper(ST->ConOut->SetCursorPosition, 3, ST->ConOut, 0, y_max-1);
-                        uefi_call_wrapper(ST->ConOut->OutputString, 2, ST->ConOut, clearline+1);
-                }
 
-                idx_highlight_prev = idx_highlight;
+                        /* typed characters narrow the list down to the matching entries */
+                        if (searching && (key.UnicodeChar == CHAR_BACKSPACE || key.ScanCode == SCAN_ESC ||
+                                          (key.UnicodeChar >= ' ' && key.UnicodeChar != '/'))) {
+                                UINTN entry = list.members[list.rows[idx_highlight].member];
+
+                                if (key.UnicodeChar == CHAR_BACKSPACE && search.len > 0)
+                                        search.query[--search.len] = '\0';
+                                else if (key.UnicodeChar == CHAR_BACKSPACE || key.ScanCode == SCAN_ESC) {
+                                        searching = FALSE;
+                                        search.len = 0;
+                                        search.query[0] = '\0';
+                                } else if (search.len < ELEMENTSOF(search.query)-1) {
+                                        search.query[search.len] = key.UnicodeChar;
+                                        /* refuse characters which would leave no entry */
+                                        if (menu_search_match(&search, config->entry_count, search.query, search.len+1) > 0)
+                                                search.query[++search.len] = '\0';
+                                        else
+                                                search.query[search.len] = '\0';
+                                }
 
-                switch (key.ScanCode) {
-                case SCAN_UP:
-                        if (idx_highlight > 0)
-                                idx_highlight--;
-                        break;
-                case SCAN_DOWN:
-                        if (idx_highlight < config->entry_count-1)
-                                idx_highlight++;
-                        break;
-                case SCAN_HOME:
-                        if (idx_highlight > 0) {
-                                refresh = TRUE;
+                                filtered = search.len > 0;
+                                if (filtered)
+                                        menu_search_match(&search, config->entry_count, search.query, search.len);
+                                menu_list_rows(&list, filtered ? search.match : NULL);
+
+                                /* keep the highlighted entry, if it is still shown */
                                 idx_highlight = 0;
+                                for (i = 0; i < list.row_count; i++)
+                                        if (list.members[list.rows[i].member] == entry)
+                                                idx_highlight = i;
+                                if (!filtered && idx_highlight == 0)
+                                        idx_highlight = menu_list_find_row(&list, entry);
+                                key.ScanCode = SCAN_NULL;
+                                key.UnicodeChar = CHAR_NULL;
                         }
-                        break;
-                case SCAN_END:
-                        if (idx_highlight < config->entry_count-1) {
-                                refresh = TRUE;
-                                idx_highlight = config->entry_count-1;
+
+                        switch (key.ScanCode) {
+                        case SCAN_UP:
+                                if (idx_highlight > 0)
+                                        idx_highlight--;
+                                break;
+                        case SCAN_DOWN:
+                                if (idx_highlight < list.row_count-1)
+                                        idx_highlight++;
+                                break;
+                        case SCAN_RIGHT:
+                                /* show the older versions */
+                                if (!filtered && list.groups[list.rows[idx_highlight].group].count > 1) {
+                                        list.groups[list.rows[idx_highlight].group].expanded = TRUE;
+                                        menu_list_rows(&list, NULL);
+                                }
+                                break;
+                        case SCAN_LEFT: {
+                                MenuGroup *group = &list.groups[list.rows[idx_highlight].group];
+
+                                /* collapse the group into the row of the newest version */
+                                if (!filtered && group->expanded) {
+                                        idx_highlight -= list.rows[idx_highlight].member - group->start;
+                                        group->expanded = FALSE;
+                                        menu_list_rows(&list, NULL);
+                                }
+                                break;
                         }
-                        break;
-                case SCAN_PAGE_UP:
-                        if (idx_highlight > visible_max)
-                                idx_highlight -= visible_max;
-                        else
+                        case SCAN_HOME:
                                 idx_highlight = 0;
-                        break;
-                case SCAN_PAGE_DOWN:
-                        idx_highlight += visible_max;
-                        if (idx_highlight > config->entry_count-1)
-                                idx_highlight = config->entry_count-1;
-                        break;
-                case SCAN_F1:
-                        status = StrDuplicate(L"(d)efault, (+/-)timeout, (e)dit, (v)ersion (q)uit (*)dump");
-                        break;
-                }
-
-                if (idx_highlight > idx_last) {
-                        idx_last = idx_highlight;
-                        idx_first = 1 + idx_highlight - visible_max;
-                        refresh = TRUE;
-                }
-                if (idx_highlight < idx_first) {
-                        idx_first = idx_highlight;
-                        idx_last = idx_highlight + visible_max-1;
-                        refresh = TRUE;
-                }
-                idx_last = idx_first + visible_max-1;
-
-                switch (key.UnicodeChar) {
-                case CHAR_LINEFEED:
-                case CHAR_CARRIAGE_RETURN:
-                        exit = TRUE;
-                        break;
-                case 'j':
-                        if (idx_highlight < config->entry_count-1)
-                                idx_highlight++;
-                        break;
-                case 'k':
-                        if (idx_highlight > 0)
-                                idx_highlight--;
-                        break;
-                case 'q':
-                        exit = TRUE;
-                        run = FALSE;
-                        break;
-                case 'd':
-                        if (config->idx_default_efivar != (INTN)idx_highlight) {
-                                /* store the selected entry in a persistent EFI variable */
-                                efivar_set(L"LoaderEntryDefault", config->entries[idx_highlight]->file, TRUE);
-                                config->idx_default_efivar = idx_highlight;
-                                status = StrDuplicate(L"Default boot entry selected.");
-                        } else {
-                                /* clear the default entry EFI variable */
-                                efivar_set(L"LoaderEntryDefault", NULL, TRUE);
-                                config->idx_default_efivar = -1;
-                                status = StrDuplicate(L"Default boot entry cleared.");
+                                break;
+                        case SCAN_END:
+                                idx_highlight = list.row_count-1;
+                                break;
+                        case SCAN_PAGE_UP:
+                                if (idx_highlight > visible_max)
+                                        idx_highlight -= visible_max;
+                                else
+                                        idx_highlight = 0;
+                                break;
+                        case SCAN_PAGE_DOWN:
+                                idx_highlight += visible_max;
+                                if (idx_highlight > list.row_count-1)
+                                        idx_highlight = list.row_count-1;
+                                break;
+                        case SCAN_F1:
+                                status = StrDuplicate(L"(d)efault (+/-)timeout (e)dit (v)ersion (q)uit (*)dump (<-/->)group (/)search");
+                                break;
                         }
-                        refresh = TRUE;
-                        break;
-                case '-':
-                        if (config->timeout_sec_efivar > 0) {
-                                config->timeout_sec_efivar--;
-                                efivar_set_int(L"LoaderConfigTimeout", config->timeout_sec_efivar, TRUE);
+
+                        switch (key.UnicodeChar) {
+                        case CHAR_LINEFEED:
+                        case CHAR_CARRIAGE_RETURN:
+                                exit = TRUE;
+                                break;
+                        case 'j':
+                                if (idx_highlight < list.row_count-1)
+                                        idx_highlight++;
+                                break;
+                        case 'k':
+                                if (idx_highlight > 0)
+                                        idx_highlight--;
+                                break;
+                        case 'q':
+                                exit = TRUE;
+                                run = FALSE;
+                                break;
+                        case '/':
+                                if (menu_search_init(&search, config))
+                                        searching = TRUE;
+                                break;
+                        case 'd':
+                                if (config->idx_default_efivar != (INTN)list.members[list.rows[idx_highlight].member]) {
+                                        config->idx_default_efivar = list.members[list.rows[idx_highlight].member];
+                                        status = StrDuplicate(L"Default boot entry selected.");
+                                } else {
+                                        config->idx_default_efivar = -1;
+                                        status = StrDuplicate(L"Default boot entry cleared.");
+                                }
+                                break;
+                        case '-':
+                                if (config->timeout_sec_efivar > 0) {
+                                        config->timeout_sec_efivar--;
+                                        if (config->timeout_sec_efivar > 0)
+                                                status = PoolPrint(L"Menu timeout set to %d sec.", config->timeout_sec_efivar);
+                                        else
+                                                status = StrDuplicate(L"Menu disabled. Hold down key at bootup to show menu.");
+                                } else if (config->timeout_sec_efivar <= 0){
+                                        config->timeout_sec_efivar = -1;
+                                        if (config->timeout_sec_config > 0)
+                                                status = PoolPrint(L"Menu timeout of %d sec is defined by configuration file.",
+                                                                   config->timeout_sec_config);
+                                        else
+                                                status = StrDuplicate(L"Menu disabled. Hold down key at bootup to show menu.");
+                                }
+                                break;
+                        case '+':
+                                if (config->timeout_sec_efivar == -1 && config->timeout_sec_config == 0)
+                                        config->timeout_sec_efivar++;
+                                config->timeout_sec_efivar++;
                                 if (config->timeout_sec_efivar > 0)
-                                        status = PoolPrint(L"Menu timeout set to %d sec.", config->timeout_sec_efivar);
-                                else
-                                        status = StrDuplicate(L"Menu disabled. Hold down key at bootup to show menu.");
-                        } else if (config->timeout_sec_efivar <= 0){
-                                config->timeout_sec_efivar = -1;
-                                efivar_set(L"LoaderConfigTimeout", NULL, TRUE);
-                                if (config->timeout_sec_config > 0)
-                                        status = PoolPrint(L"Menu timeout of %d sec is defined by configuration file.",
-                                                           config->timeout_sec_config);
+                                        status = PoolPrint(L"Menu timeout set to %d sec.",
+                                                           config->timeout_sec_efivar);
                                 else
                                         status = StrDuplicate(L"Menu disabled. Hold down key at bootup to show menu.");
+                                break;
+                        case 'e':
+                                /* line_edit() draws into the last line of the screen itself */
+                                screen_fill(&screen, 0, y_max-1, x_max, EFI_LIGHTGRAY|EFI_BACKGROUND_BLACK);
+                                screen_flush(&screen);
+                                screen_release(&screen);
+                                uefi_call_wrapper(ST->ConOut->SetAttribute, 2, ST->ConOut, EFI_LIGHTGRAY|EFI_BACKGROUND_BLACK);
+                                if (line_edit(config->entries[list.members[list.rows[idx_highlight].member]]->options,
+                                              &config->options_edit, text_x_max-1, text_y_max-1))
+                                        exit = TRUE;
+                                if (screen.gop) {
+                                        /* the text console does not line up with the grid */
+                                        uefi_call_wrapper(ST->ConOut->ClearScreen, 1, ST->ConOut);
+                                        screen_reset(&screen);
+                                } else
+                                        screen_invalidate(&screen, y_max-1, 1);
+                                break;
+                        case 'v':
+                                status = PoolPrint(L"gummiboot " stringify(VERSION) ", UEFI %d.%02d, %s %d.%02d",
+                                                   ST->Hdr.Revision >> 16, ST->Hdr.Revision & 0xffff,
+                                                   ST->FirmwareVendor, ST->FirmwareRevision >> 16, ST->FirmwareRevision & 0xffff);
+                                break;
+                        case '*':
+                                /* leaves a cleared screen behind */
+                                screen_release(&screen);
+                                dump_status(config, loaded_image_path);
+                                screen_reset(&screen);
+                                break;
                         }
-                        break;
-                case '+':
-                        if (config->timeout_sec_efivar == -1 && config->timeout_sec_config == 0)
-                                config->timeout_sec_efivar++;
-                        config->timeout_sec_efivar++;
+
+                        if (idx_highlight > idx_last) {
+                                idx_last = idx_highlight;
+                                idx_first = 1 + idx_highlight - visible_max;
+                        }
+                        if (idx_highlight < idx_first) {
+                                idx_first = idx_highlight;
+                                idx_last = idx_highlight + visible_max-1;
+                        }
+                        idx_last = idx_first + visible_max-1;
+
+                        if (searching && !status)
+                                status = PoolPrint(L"/%s", search.query);
+                } while (!exit && uefi_call_wrapper(ST->ConIn->ReadKeyStroke, 2, ST->ConIn, &key) == EFI_SUCCESS);
+
+                /* the preloaded image is dropped when the selection moves */
+                image_reader_select(reader, config->entries[list.members[list.rows[idx_highlight].member]]);
+        }
+
+        *chosen_entry = config->entries[list.members[list.rows[idx_highlight].member]];
+
+        /* store the selected default entry and the timeout in persistent EFI variables */
+        if (config->idx_default_efivar != idx_default_efivar) {
+                if (config->idx_default_efivar >= 0)
+                        efivar_set(L"LoaderEntryDefault", config->entries[config->idx_default_efivar]->file, TRUE);
+                else
+                        efivar_set(L"LoaderEntryDefault", NULL, TRUE);
+        }
+        if (config->timeout_sec_efivar != timeout_sec_efivar) {
+                if (config->timeout_sec_efivar >= 0)
                         efivar_set_int(L"LoaderConfigTimeout", config->timeout_sec_efivar, TRUE);
-                        if (config->timeout_sec_efivar > 0)
-                                status = PoolPrint(L"Menu timeout set to %d sec.",
-                                                   config->timeout_sec_efivar);
-                        else
-                                status = StrDuplicate(L"Menu disabled. Hold down key at bootup to show menu.");
-                        break;
-                case 'e':
-                        uefi_call_wrapper(ST->ConOut->SetAttribute, 2, ST->ConOut, EFI_LIGHTGRAY|EFI_BACKGROUND_BLACK);
-                        uefi_call_wrapper(ST->ConOut->SetCursorPosition, 3, ST->ConOut, 0, y_max-1);
-                        uefi_call_wrapper(ST->ConOut->OutputString, 2, ST->ConOut, clearline+1);
-                        if (line_edit(config->entries[idx_highlight]->options, &config->options_edit, x_max-1, y_max-1))
-                                exit = TRUE;
-                        uefi_call_wrapper(ST->ConOut->SetCursorPosition, 3, ST->ConOut, 0, y_max-1);
-                        uefi_call_wrapper(ST->ConOut->OutputString, 2, ST->ConOut, clearline+1);
-                        break;
-                case 'v':
-                        status = PoolPrint(L"gummiboot " stringify(VERSION) ", UEFI %d.%02d, %s %d.%02d",
-                                           ST->Hdr.Revision >> 16, ST->Hdr.Revision & 0xffff,
-                                           ST->FirmwareVendor, ST->FirmwareRevision >> 16, ST->FirmwareRevision & 0xffff);
-                        break;
-                case '*':
-                        dump_status(config, loaded_image_path);
-                        refresh = TRUE;
-                        break;
-                }
+                else
+                        efivar_set(L"LoaderConfigTimeout", NULL, TRUE);
+        }
+
+        FreePool(status);
+        menu_search_free(&search);
+        menu_list_free(&list);
+        screen_release(&screen);
+        screen_free(&screen);
+        if (timer_event)
+                uefi_call_wrapper(BS->CloseEvent, 1, timer_event);
+        if (preload_event)
+                uefi_call_wrapper(BS->CloseEvent, 1, preload_event);
+
+        uefi_call_wrapper(ST->ConOut->SetAttribute, 2, ST->ConOut, EFI_WHITE|EFI_BACKGROUND_BLACK);
+        uefi_call_wrapper(ST->ConOut->ClearScreen, 1, ST->ConOut);
+        return run;
+}
+
+#define ARENA_BLOCK_PAGES 4
+
+static VOID *arena_alloc(Arena *arena, UINTN size) {
+        VOID *p;
+
+        size = (size + 7) & ~7;
+        if (size > (UINTN)(arena->end - arena->pos)) {
+                EFI_PHYSICAL_ADDRESS addr;
+                ArenaBlock *block;
+                UINTN pages;
+                EFI_STATUS err;
+
+                /* double the block size every time, the rest of the current block is abandoned */
+                pages = arena->block_pages > 0 ? arena->block_pages * 2 : ARENA_BLOCK_PAGES;
+                while (pages * EFI_PAGE_SIZE < sizeof(ArenaBlock) + size)
+                        pages *= 2;
+
+                err = uefi_call_wrapper(BS->AllocatePages, 4, AllocateAnyPages, EfiLoaderData, pages, &addr);
+                if (EFI_ERROR(err))
+                        return NULL;
+
+                block = (ArenaBlock *)(UINTN)addr;
+                block->next = arena->blocks;
+                block->pages = pages;
+                arena->blocks = block;
+                arena->block_pages = pages;
+                arena->block_count++;
+                arena->pages += pages;
+                arena->pos = (UINT8 *)block + ((sizeof(ArenaBlock) + 7) & ~7);
+                arena->end = (UINT8 *)block + pages * EFI_PAGE_SIZE;
+        }
+
+        p = arena->pos;
+        arena->pos += size;
+        arena->alloc_count++;
+        arena->alloc_size += size;
+        return p;
+}
+
+static VOID *arena_alloc_zero(Arena *arena, UINTN size) {
+        VOID *p;
+
+        p = arena_alloc(arena, size);
+        if (p)
+                ZeroMem(p, size);
+        return p;
+}
+
+static CHAR16 *arena_strdup(Arena *arena, const CHAR16 *str) {
+        CHAR16 *s;
+        UINTN size;
+
+        size = StrSize(str);
+        s = arena_alloc(arena, size);
+        if (s)
+                CopyMem(s, str, size);
+        return s;
+}
+
+/* concatenate a NULL-terminated list of strings */
+static CHAR16 *arena_strcat(Arena *arena, const CHAR16 *str, ...) {
+        VA_LIST args;
+        const CHAR16 *s;
+        CHAR16 *cat;
+        UINTN len = 0;
+        UINTN pos = 0;
 
-                if (!refresh && idx_highlight != idx_highlight_prev)
-                        highlight = TRUE;
-        }
+        VA_START(args, str);
+        for (s = str; s; s = VA_ARG(args, const CHAR16 *))
+                len += StrLen(s);
+        VA_END(args);
 
-        *chosen_entry = config->entries[idx_highlight];
+        cat = arena_alloc(arena, (len + 1) * sizeof(CHAR16));
+        if (!cat)
+                return NULL;
 
-        for (i = 0; i < config->entry_count; i++)
-                FreePool(lines[i]);
-        FreePool(lines);
-        FreePool(clearline);
+        VA_START(args, str);
+        for (s = str; s; s = VA_ARG(args, const CHAR16 *)) {
+                len = StrLen(s);
+                CopyMem(cat + pos, s, len * sizeof(CHAR16));
+                pos += len;
+        }
+        VA_END(args);
+        cat[pos] = '\0';
+        return cat;
+}
 
-        uefi_call_wrapper(ST->ConOut->SetAttribute, 2, ST->ConOut, EFI_WHITE|EFI_BACKGROUND_BLACK);
-        uefi_call_wrapper(ST->ConOut->ClearScreen, 1, ST->ConOut);
-        return run;
+static VOID arena_free(Arena *arena) {
+        while (arena->blocks) {
+                ArenaBlock *block;
+
+                block = arena->blocks;
+                arena->blocks = block->next;
+                uefi_call_wrapper(BS->FreePages, 2, (EFI_PHYSICAL_ADDRESS)(UINTN)block, block->pages);
+        }
+        ZeroMem(arena, sizeof(Arena));
 }
 
 static VOID config_add_entry(Config *config, ConfigEntry *entry) {
-        if ((config->entry_count & 15) == 0) {
+        /* grow the array to 16 entries first, then double it every time it is full */
+        if (config->entry_count == 0 ||
+            (config->entry_count >= 16 && (config->entry_count & (config->entry_count - 1)) == 0)) {
+                ConfigEntry **entries;
                 UINTN i;
 
-                i = config->entry_count + 16;
-                if (config->entry_count == 0)
-                        config->entries = AllocatePool(sizeof(VOID *) * i);
-                else
-                        config->entries = ReallocatePool(config->entries,
-                                                         sizeof(VOID *) * config->entry_count, sizeof(VOID *) * i);
+                i = config->entry_count > 0 ? config->entry_count * 2 : 16;
+                entries = arena_alloc(&config->arena, sizeof(VOID *) * i);
+                if (config->entry_count > 0)
+                        CopyMem(entries, config->entries, sizeof(VOID *) * config->entry_count);
+                config->entries = entries;
         }
         config->entries[config->entry_count++] = entry;
 }
 
-static VOID config_entry_free(ConfigEntry *entry) {
-        FreePool(entry->title_show);
-        FreePool(entry->title);
-        FreePool(entry->machine_id);
-        FreePool(entry->loader);
-        FreePool(entry->options);
-}
-
 static BOOLEAN is_digit(CHAR16 c)
 {
         return (c >= '0') && (c <= '9');
@@ -976,47 +2834,119 @@ static UINTN c_order(CHAR16 c)
                 return c + 0x10000;
 }
 
-static INTN str_verscmp(CHAR16 *s1, CHAR16 *s2)
-{
-        CHAR16 *os1 = s1;
-        CHAR16 *os2 = s2;
+/*
+ * The version sort key of a string, a sequence of symbols which compares like
+ * the strings in version order: every run of non-digits is stored as the
+ * order of its characters followed by a 0, every run of digits as the number
+ * of its digits without leading zeros, followed by these digits. Missing
+ * symbols at the end of the shorter key count as 0. The key of a string is at
+ * most three times as long as the string.
+ */
+static UINTN version_key(CHAR16 *s, UINT32 *key) {
+        UINTN n = 0;
+
+        while (*s) {
+                UINTN len;
+
+                while (*s && !is_digit(*s))
+                        key[n++] = c_order(*s++);
+                key[n++] = 0;
+
+                while (*s == '0')
+                        s++;
+                for (len = 0; is_digit(s[len]); len++)
+                        ;
+                key[n++] = len;
+                while (len--)
+                        key[n++] = *s++;
+        }
 
-        while (*s1 || *s2) {
-                INTN first;
+        return n;
+}
 
-                while ((*s1 && !is_digit(*s1)) || (*s2 && !is_digit(*s2))) {
-                        INTN order;
+typedef struct {
+        ConfigEntry *entry;
+        UINT32 *key;
+        UINTN key_len;
+} SortItem;
 
-                        order = c_order(*s1) - c_order(*s2);
-                        if (order)
-                                return order;
-                        s1++;
-                        s2++;
-                }
+static INTN sort_item_cmp(SortItem *a, SortItem *b) {
+        UINTN i;
 
-                while (*s1 == '0')
-                        s1++;
-                while (*s2 == '0')
-                        s2++;
-
-                first = 0;
-                while (is_digit(*s1) && is_digit(*s2)) {
-                        if (first == 0)
-                                first = *s1 - *s2;
-                        s1++;
-                        s2++;
-                }
+        for (i = 0; i < a->key_len || i < b->key_len; i++) {
+                UINT32 ka = i < a->key_len ? a->key[i] : 0;
+                UINT32 kb = i < b->key_len ? b->key[i] : 0;
 
-                if (is_digit(*s1))
-                        return 1;
-                if (is_digit(*s2))
-                        return -1;
+                if (ka != kb)
+                        return ka < kb ? -1 : 1;
+        }
+
+        return StrCmp(a->entry->file, b->entry->file);
+}
+
+/* sort entries after version number, a stable bottom-up merge sort */
+static VOID config_sort_entries(Config *config) {
+        SortItem *items = NULL, *src, *dst;
+        UINT32 *keys = NULL;
+        UINTN n = config->entry_count;
+        UINTN size = 0;
+        UINTN width;
+        UINTN i;
+
+        if (n < 2)
+                return;
+
+        for (i = 0; i < n; i++)
+                size += StrLen(config->entries[i]->file) * 3;
+        items = AllocatePool(2 * n * sizeof(SortItem));
+        keys = AllocatePool((size + 1) * sizeof(UINT32));
+        if (!items || !keys)
+                goto out;
+
+        size = 0;
+        for (i = 0; i < n; i++) {
+                items[i].entry = config->entries[i];
+                items[i].key = keys + size;
+                items[i].key_len = version_key(config->entries[i]->file, items[i].key);
+                size += items[i].key_len;
+        }
+
+        src = items;
+        dst = items + n;
+        for (width = 1; width < n; width *= 2) {
+                SortItem *t;
+
+                for (i = 0; i < n; i += 2 * width) {
+                        UINTN l = i;
+                        UINTN mid = i + width < n ? i + width : n;
+                        UINTN r = mid;
+                        UINTN end = i + 2 * width < n ? i + 2 * width : n;
+                        UINTN k = i;
+
+                        /* take from the left run on equal keys, to keep the sort stable */
+                        while (l < mid && r < end) {
+                                if (sort_item_cmp(&src[r], &src[l]) < 0)
+                                        dst[k++] = src[r++];
+                                else
+                                        dst[k++] = src[l++];
+                        }
+                        while (l < mid)
+                                dst[k++] = src[l++];
+                        while (r < end)
+                                dst[k++] = src[r++];
+                }
 
-                if (first)
-                        return first;
+                t = src;
+                src = dst;
+                dst = t;
         }
 
-        return StrCmp(os1, os2);
+        for (i = 0; i < n; i++)
+                config->entries[i] = src[i].entry;
+
+out:
+        FreePool(keys);
+        FreePool(items);
 }
 
 static INTN utf8_to_16(CHAR8 *stra, CHAR16 *c) {
@@ -1071,14 +3001,12 @@ static INTN utf8_to_16(CHAR8 *stra, CHAR16 *c) {
         return len;
 }
 
-static CHAR16 *stra_to_str(CHAR8 *stra) {
+static CHAR16 *stra_to_str(Arena *arena, CHAR8 *stra, UINTN len) {
         UINTN strlen;
-        UINTN len;
         UINTN i;
         CHAR16 *str;
 
-        len = strlena(stra);
-        str = AllocatePool((len + 1) * sizeof(CHAR16));
+        str = arena_alloc(arena, (len + 1) * sizeof(CHAR16));
 
         strlen = 0;
         i = 0;
@@ -1086,7 +3014,7 @@ static CHAR16 *stra_to_str(CHAR8 *stra) {
                 INTN utf8len;
 
                 utf8len = utf8_to_16(stra + i, str + strlen);
-                if (utf8len <= 0) {
+                if (utf8len <= 0 || i + (UINTN)utf8len > len) {
                         /* invalid utf8 sequence, skip the garbage */
                         i++;
                         continue;
@@ -1099,14 +3027,12 @@ static CHAR16 *stra_to_str(CHAR8 *stra) {
         return str;
 }
 
-static CHAR16 *stra_to_path(CHAR8 *stra) {
+static CHAR16 *stra_to_path(Arena *arena, CHAR8 *stra, UINTN len) {
         CHAR16 *str;
         UINTN strlen;
-        UINTN len;
         UINTN i;
 
-        len = strlena(stra);
-        str = AllocatePool((len + 2) * sizeof(CHAR16));
+        str = arena_alloc(arena, (len + 2) * sizeof(CHAR16));
 
         str[0] = '\\';
         strlen = 1;
@@ -1115,7 +3041,7 @@ static CHAR16 *stra_to_path(CHAR8 *stra) {
                 INTN utf8len;
 
                 utf8len = utf8_to_16(stra + i, str + strlen);
-                if (utf8len <= 0) {
+                if (utf8len <= 0 || i + (UINTN)utf8len > len) {
                         /* invalid utf8 sequence, skip the garbage */
                         i++;
                         continue;
@@ -1136,200 +3062,166 @@ static CHAR16 *stra_to_path(CHAR8 *stra) {
         return str;
 }
 
-static CHAR8 *strchra(CHAR8 *s, CHAR8 c) {
-        do {
-                if (*s == c)
-                        return s;
-        } while (*s++);
-        return NULL;
-}
-
-static CHAR8 *line_get_key_value(CHAR8 *content, UINTN *pos, CHAR8 **key_ret, CHAR8 **value_ret) {
-        CHAR8 *line;
-        UINTN linelen;
-        CHAR8 *value;
-
-skip:
-        line = content + *pos;
-        if (*line == '\0')
-                return NULL;
-
-        linelen = 0;
-        while (line[linelen] && !strchra((CHAR8 *)"\n\r", line[linelen]))
-               linelen++;
-
-        /* move pos to next line */
-        *pos += linelen;
-        if (content[*pos])
-                (*pos)++;
+enum config_key {
+        KEY_TIMEOUT = 1,
+        KEY_DEFAULT,
+        KEY_TITLE,
+        KEY_VERSION,
+        KEY_MACHINE_ID,
+        KEY_LINUX,
+        KEY_EFI,
+        KEY_INITRD,
+        KEY_OPTIONS,
+        KEY_CONSOLE,
+        KEY_READ_CHUNK,
+};
 
-        /* empty line */
-        if (linelen == 0)
-                goto skip;
+/* (first character + length) % 32 is unique for all known keys */
+#define CONFIG_KEY_HASH(c, len) (((c) + (len)) % 32)
 
-        /* terminate line */
-        line[linelen] = '\0';
+static const struct {
+        CHAR8 name[11];
+        UINTN len;
+        enum config_key key;
+} config_keys[32] = {
+        [CONFIG_KEY_HASH('t', 7)] =  { "timeout",    7,  KEY_TIMEOUT },
+        [CONFIG_KEY_HASH('d', 7)] =  { "default",    7,  KEY_DEFAULT },
+        [CONFIG_KEY_HASH('t', 5)] =  { "title",      5,  KEY_TITLE },
+        [CONFIG_KEY_HASH('v', 7)] =  { "version",    7,  KEY_VERSION },
+        [CONFIG_KEY_HASH('m', 10)] = { "machine-id", 10, KEY_MACHINE_ID },
+        [CONFIG_KEY_HASH('l', 5)] =  { "linux",      5,  KEY_LINUX },
+        [CONFIG_KEY_HASH('e', 3)] =  { "efi",        3,  KEY_EFI },
+        [CONFIG_KEY_HASH('i', 6)] =  { "initrd",     6,  KEY_INITRD },
+        [CONFIG_KEY_HASH('o', 7)] =  { "options",    7,  KEY_OPTIONS },
+        [CONFIG_KEY_HASH('c', 7)] =  { "console",    7,  KEY_CONSOLE },
+        [CONFIG_KEY_HASH('r', 10)] = { "read-chunk", 10, KEY_READ_CHUNK },
+};
 
-        /* remove leading whitespace */
-        while (strchra((CHAR8 *)" \t", *line)) {
-                line++;
-                linelen--;
-        }
+static BOOLEAN is_blank(CHAR8 c) {
+        return c == ' ' || c == '\t';
+}
 
-        /* remove trailing whitespace */
-        while (linelen > 0 && strchra((CHAR8 *)" \t", line[linelen-1]))
-                linelen--;
-        line[linelen] = '\0';
+static BOOLEAN is_newline(CHAR8 c) {
+        return c == '\n' || c == '\r';
+}
 
-        if (*line == '#')
-                goto skip;
+/*
+ * Find the next line with a known key and a value in a NUL-terminated buffer,
+ * in a single pass. The value is returned as a slice into the buffer, the
+ * buffer is not modified.
+ */
+static BOOLEAN line_get_key_value(CHAR8 *content, UINTN *pos, enum config_key *key_ret, CHAR8 **value_ret, UINTN *value_len) {
+        CHAR8 *s = content + *pos;
 
-        /* split key/value */
-        value = line;
-        while (*value && !strchra((CHAR8 *)" \t", *value))
-                value++;
-        if (*value == '\0')
-                goto skip;
-        *value = '\0';
-        value++;
-        while (*value && strchra((CHAR8 *)" \t", *value))
-                value++;
+        for (;;) {
+                CHAR8 *key, *value, *end;
+                UINTN key_len;
+                UINTN h;
+
+                /* skip whitespace and empty lines */
+                while (is_blank(*s) || is_newline(*s))
+                        s++;
+                if (*s == '\0')
+                        break;
 
-        *key_ret = line;
-        *value_ret = value;
-        return line;
-}
+                key = s;
+                while (*s && !is_blank(*s) && !is_newline(*s))
+                        s++;
+                key_len = s - key;
 
-static VOID config_defaults_load_from_file(Config *config, CHAR8 *content) {
-        CHAR8 *line;
-        UINTN pos = 0;
-        CHAR8 *key, *value;
+                while (is_blank(*s))
+                        s++;
+                value = s;
+                while (*s && !is_newline(*s))
+                        s++;
 
-        line = content;
-        while ((line = line_get_key_value(content, &pos, &key, &value))) {
-                if (strcmpa((CHAR8 *)"timeout", key) == 0) {
-                        CHAR16 *s;
+                /* remove trailing whitespace */
+                end = s;
+                while (end > value && is_blank(end[-1]))
+                        end--;
 
-                        s = stra_to_str(value);
-                        config->timeout_sec_config = Atoi(s);
-                        config->timeout_sec = config->timeout_sec_config;
-                        FreePool(s);
+                /* comments, keys without a value, and unknown keys */
+                if (key[0] == '#' || end == value)
                         continue;
-                }
-                if (strcmpa((CHAR8 *)"default", key) == 0) {
-                        config->entry_default_pattern = stra_to_str(value);
-                        StrLwr(config->entry_default_pattern);
+                h = CONFIG_KEY_HASH(key[0], key_len);
+                if (config_keys[h].len != key_len || CompareMem(config_keys[h].name, key, key_len) != 0)
                         continue;
-                }
+
+                *key_ret = config_keys[h].key;
+                *value_ret = value;
+                *value_len = end - value;
+                *pos = s - content;
+                return TRUE;
         }
+
+        *pos = s - content;
+        return FALSE;
 }
 
-static VOID config_entry_add_from_file(Config *config, EFI_HANDLE *device, CHAR16 *file, CHAR8 *content, CHAR16 *loaded_image_path) {
-        ConfigEntry *entry;
-        CHAR8 *line;
+static VOID config_defaults_load_from_file(Config *config, CHAR8 *content) {
         UINTN pos = 0;
-        CHAR8 *key, *value;
+        enum config_key key;
+        CHAR8 *value;
         UINTN len;
-        CHAR16 *initrd = NULL;
-
-        entry = AllocateZeroPool(sizeof(ConfigEntry));
-
-        line = content;
-        while ((line = line_get_key_value(content, &pos, &key, &value))) {
-                if (strcmpa((CHAR8 *)"title", key) == 0) {
-                        FreePool(entry->title);
-                        entry->title = stra_to_str(value);
-                        continue;
-                }
-
-                if (strcmpa((CHAR8 *)"version", key) == 0) {
-                        FreePool(entry->version);
-                        entry->version = stra_to_str(value);
-                        continue;
-                }
 
-                if (strcmpa((CHAR8 *)"machine-id", key) == 0) {
-                        FreePool(entry->machine_id);
-                        entry->machine_id = stra_to_str(value);
-                        continue;
-                }
+        while (line_get_key_value(content, &pos, &key, &value, &len)) {
+                switch (key) {
+                case KEY_TIMEOUT: {
+                        UINTN i;
 
-                if (strcmpa((CHAR8 *)"linux", key) == 0) {
-                        FreePool(entry->loader);
-                        entry->type = LOADER_LINUX;
-                        entry->loader = stra_to_path(value);
-                        continue;
+                        config->timeout_sec_config = 0;
+                        for (i = 0; i < len && value[i] >= '0' && value[i] <= '9'; i++)
+                                config->timeout_sec_config = config->timeout_sec_config * 10 + value[i] - '0';
+                        config->timeout_sec = config->timeout_sec_config;
+                        break;
                 }
 
-                if (strcmpa((CHAR8 *)"efi", key) == 0) {
-                        entry->type = LOADER_EFI;
-                        FreePool(entry->loader);
-                        entry->loader = stra_to_path(value);
-
-                        /* do not add an entry for ourselves */
-                        if (StriCmp(entry->loader, loaded_image_path) == 0) {
-                                entry->type = LOADER_UNDEFINED;
-                                break;
-                        }
-                        continue;
-                }
+                case KEY_DEFAULT:
+                        config->entry_default_pattern = stra_to_str(&config->arena, value, len);
+                        StrLwr(config->entry_default_pattern);
+                        break;
 
-                if (strcmpa((CHAR8 *)"initrd", key) == 0) {
-                        CHAR16 *new;
+                case KEY_CONSOLE:
+                        if (len == 4 && CompareMem(value, "text", 4) == 0)
+                                config->console = CONSOLE_TEXT;
+                        else if (len == 8 && CompareMem(value, "graphics", 8) == 0)
+                                config->console = CONSOLE_GRAPHICS;
+                        else if (len == 6 && CompareMem(value, "serial", 6) == 0)
+                                config->console = CONSOLE_SERIAL;
+                        else if (len == 4 && CompareMem(value, "auto", 4) == 0)
+                                config->console = CONSOLE_AUTO;
+                        break;
 
-                        new = stra_to_path(value);
-                        if (initrd) {
-                                CHAR16 *s;
+                case KEY_READ_CHUNK: {
+                        UINTN kib = 0;
+                        UINTN i;
 
-                                s = PoolPrint(L"%s initrd=%s", initrd, new);
-                                FreePool(initrd);
-                                initrd = s;
-                        } else
-                                initrd = PoolPrint(L"initrd=%s", new);
-                        FreePool(new);
-                        continue;
+                        /* KiB per read of an image, rounded up to whole pages */
+                        for (i = 0; i < len && value[i] >= '0' && value[i] <= '9' && kib < 1024 * 1024; i++)
+                                kib = kib * 10 + value[i] - '0';
+                        if (kib > 1024 * 1024)
+                                kib = 1024 * 1024;
+                        config->read_chunk = EFI_PAGES_TO_SIZE(EFI_SIZE_TO_PAGES(kib * 1024));
+                        break;
                 }
 
-                if (strcmpa((CHAR8 *)"options", key) == 0) {
-                        CHAR16 *new;
-
-                        new = stra_to_str(value);
-                        if (entry->options) {
-                                CHAR16 *s;
-
-                                s = PoolPrint(L"%s %s", entry->options, new);
-                                FreePool(entry->options);
-                                entry->options = s;
-                        } else {
-                                entry->options = new;
-                                new = NULL;
-                        }
-                        FreePool(new);
-                        continue;
+                default:
+                        break;
                 }
         }
+}
 
-        if (entry->type == LOADER_UNDEFINED) {
-                config_entry_free(entry);
-                FreePool(initrd);
-                FreePool(entry);
-                return;
-        }
+/* add the initrds and the options from EFI variables to a parsed entry, and add it to the list */
+static VOID config_entry_add_finish(Config *config, ConfigEntry *entry, EFI_HANDLE *device, CHAR16 *file, CHAR16 *initrd) {
+        UINTN len;
 
         /* add initrd= to options */
         if (entry->type == LOADER_LINUX && initrd) {
-                if (entry->options) {
-                        CHAR16 *s;
-
-                        s = PoolPrint(L"%s %s", initrd, entry->options);
-                        FreePool(entry->options);
-                        entry->options = s;
-                } else {
+                if (entry->options)
+                        entry->options = arena_strcat(&config->arena, initrd, L" ", entry->options, NULL);
+                else
                         entry->options = initrd;
-                        initrd = NULL;
-                }
         }
-        FreePool(initrd);
 
         if (entry->machine_id) {
                 CHAR16 *var;
@@ -1340,14 +3232,11 @@ static VOID config_entry_add_from_file(Config *config, EFI_HANDLE *device, CHAR1
                         CHAR16 *s;
 
                         if (efivar_get(var, &s) == EFI_SUCCESS) {
-                                if (entry->options) {
-                                        CHAR16 *s2;
-
-                                        s2 = PoolPrint(L"%s %s", entry->options, s);
-                                        FreePool(entry->options);
-                                        entry->options = s2;
-                                } else
-                                        entry->options = s;
+                                if (entry->options)
+                                        entry->options = arena_strcat(&config->arena, entry->options, L" ", s, NULL);
+                                else
+                                        entry->options = arena_strdup(&config->arena, s);
+                                FreePool(s);
                         }
                         FreePool(var);
                 }
@@ -1357,14 +3246,11 @@ static VOID config_entry_add_from_file(Config *config, EFI_HANDLE *device, CHAR1
                         CHAR16 *s;
 
                         if (efivar_get(var, &s) == EFI_SUCCESS) {
-                                if (entry->options) {
-                                        CHAR16 *s2;
-
-                                        s2 = PoolPrint(L"%s %s", entry->options, s);
-                                        FreePool(entry->options);
-                                        entry->options = s2;
-                                } else
-                                        entry->options = s;
+                                if (entry->options)
+                                        entry->options = arena_strcat(&config->arena, entry->options, L" ", s, NULL);
+                                else
+                                        entry->options = arena_strdup(&config->arena, s);
+                                FreePool(s);
                                 efivar_set(var, NULL, TRUE);
                         }
                         FreePool(var);
@@ -1372,7 +3258,7 @@ static VOID config_entry_add_from_file(Config *config, EFI_HANDLE *device, CHAR1
         }
 
         entry->device = device;
-        entry->file = StrDuplicate(file);
+        entry->file = arena_strdup(&config->arena, file);
         len = StrLen(entry->file);
         /* remove ".conf" */
         if (len > 5)
@@ -1382,6 +3268,93 @@ static VOID config_entry_add_from_file(Config *config, EFI_HANDLE *device, CHAR1
         config_add_entry(config, entry);
 }
 
+static VOID config_entry_add_from_file(Config *config, EFI_HANDLE *device, CHAR16 *file, CHAR8 *content, CHAR16 *loaded_image_path) {
+        Arena *arena = &config->arena;
+        ConfigEntry *entry;
+        UINTN pos = 0;
+        enum config_key key;
+        CHAR8 *value;
+        UINTN len;
+        CHAR8 *title = NULL, *version = NULL, *machine_id = NULL, *loader = NULL;
+        UINTN title_len = 0, version_len = 0, machine_id_len = 0, loader_len = 0;
+        enum loader_type type = LOADER_UNDEFINED;
+        CHAR16 *initrd = NULL;
+        CHAR16 *options = NULL;
+
+        /* only remember where the values are, the last one of every key wins */
+        while (line_get_key_value(content, &pos, &key, &value, &len)) {
+                switch (key) {
+                case KEY_TITLE:
+                        title = value;
+                        title_len = len;
+                        break;
+
+                case KEY_VERSION:
+                        version = value;
+                        version_len = len;
+                        break;
+
+                case KEY_MACHINE_ID:
+                        machine_id = value;
+                        machine_id_len = len;
+                        break;
+
+                case KEY_LINUX:
+                case KEY_EFI:
+                        type = key == KEY_LINUX ? LOADER_LINUX : LOADER_EFI;
+                        loader = value;
+                        loader_len = len;
+                        break;
+
+                case KEY_INITRD: {
+                        CHAR16 *new;
+
+                        new = stra_to_path(arena, value, len);
+                        if (initrd)
+                                initrd = arena_strcat(arena, initrd, L" initrd=", new, NULL);
+                        else
+                                initrd = arena_strcat(arena, L"initrd=", new, NULL);
+                        break;
+                }
+
+                case KEY_OPTIONS: {
+                        CHAR16 *new;
+
+                        new = stra_to_str(arena, value, len);
+                        if (options)
+                                options = arena_strcat(arena, options, L" ", new, NULL);
+                        else
+                                options = new;
+                        break;
+                }
+
+                default:
+                        break;
+                }
+        }
+
+        if (type == LOADER_UNDEFINED)
+                return;
+
+        entry = arena_alloc_zero(arena, sizeof(ConfigEntry));
+        entry->type = type;
+        entry->loader = stra_to_path(arena, loader, loader_len);
+
+        /* do not add an entry for ourselves, the memory is released with the config */
+        if (type == LOADER_EFI && StriCmp(entry->loader, loaded_image_path) == 0)
+                return;
+
+        if (title)
+                entry->title = stra_to_str(arena, title, title_len);
+        if (version)
+                entry->version = stra_to_str(arena, version, version_len);
+        if (machine_id)
+                entry->machine_id = stra_to_str(arena, machine_id, machine_id_len);
+        entry->options = options;
+
+        config_entry_add_finish(config, entry, device, file, initrd);
+}
+
 static UINTN file_read(EFI_FILE_HANDLE dir, const CHAR16 *name, CHAR8 **content) {
         EFI_FILE_HANDLE handle;
         EFI_FILE_INFO *info;
@@ -1412,15 +3385,222 @@ out:
         return len;
 }
 
-static VOID config_load(Config *config, EFI_HANDLE *device, EFI_FILE *root_dir, CHAR16 *loaded_image_path) {
-        EFI_FILE_HANDLE entries_dir;
+static BOOLEAN is_entry_file(EFI_FILE_INFO *f) {
+        UINTN len;
+
+        if (f->FileName[0] == '.')
+                return FALSE;
+        if (f->Attribute & EFI_FILE_DIRECTORY)
+                return FALSE;
+        len = StrLen(f->FileName);
+        if (len < 6)
+                return FALSE;
+        if (StriCmp(f->FileName + len - 5, L".conf") != 0)
+                return FALSE;
+        return TRUE;
+}
+
+/*
+ * Pre-parsed entries, written by the setup tool to \loader\entries.idx. The
+ * index is only used if it still matches the names, sizes and modification
+ * times of all \loader\entries\*.conf files.
+ */
+#define ENTRIES_INDEX_VERSION 1
+
+typedef struct {
+        CHAR8 magic[8];
+        UINT32 version;
+        UINT32 entry_count;
+        UINT32 size;
+        UINT32 reserved;
+} EntriesIndexHeader;
+
+/* followed by the NUL-terminated UTF-16 strings, the record size is aligned to 8 bytes */
+typedef struct {
+        UINT32 size;
+        UINT32 type;
+        UINT64 file_size;
+        UINT16 year;
+        UINT8 month;
+        UINT8 day;
+        UINT8 hour;
+        UINT8 minute;
+        UINT8 second;
+        UINT8 reserved;
+} EntriesIndexRecord;
+
+enum {
+        INDEX_FILE,
+        INDEX_TITLE,
+        INDEX_VERSION,
+        INDEX_MACHINE_ID,
+        INDEX_LOADER,
+        INDEX_INITRD,
+        INDEX_OPTIONS,
+        INDEX_STRINGS_MAX
+};
+
+typedef struct {
+        EntriesIndexRecord *record;
+        CHAR16 *strings[INDEX_STRINGS_MAX];
+        BOOLEAN seen;
+} EntriesIndexItem;
+
+static BOOLEAN index_time_match(EntriesIndexRecord *record, EFI_TIME *time) {
+        /* FAT stores the modification time with a two second granularity */
+        return record->year == time->Year &&
+               record->month == time->Month &&
+               record->day == time->Day &&
+               record->hour == time->Hour &&
+               record->minute == time->Minute &&
+               record->second / 2 == time->Second / 2;
+}
+
+static CHAR16 *index_string(Arena *arena, CHAR16 *s) {
+        if (!s[0])
+                return NULL;
+        return arena_strdup(arena, s);
+}
+
+static BOOLEAN config_load_index(Config *config, EFI_HANDLE *device, EFI_FILE *root_dir, EFI_FILE_HANDLE entries_dir,
+                                 CHAR16 *loaded_image_path) {
+        CHAR8 *content = NULL;
+        EntriesIndexHeader *header;
+        EntriesIndexItem *items = NULL;
+        UINTN len;
+        UINTN pos;
+        UINTN next;
+        UINTN found;
+        UINTN i;
+        BOOLEAN valid = FALSE;
+
+        len = file_read(root_dir, L"\\loader\\entries.idx", &content);
+        if (len < sizeof(EntriesIndexHeader))
+                goto out;
+
+        header = (EntriesIndexHeader *)content;
+        if (CompareMem(header->magic, "GUMMIIDX", 8) != 0)
+                goto out;
+        if (header->version != ENTRIES_INDEX_VERSION || header->size != len)
+                goto out;
+        /* the count comes from the file, it must not overflow the allocation */
+        if (header->entry_count > (len - sizeof(EntriesIndexHeader)) / sizeof(EntriesIndexRecord))
+                goto out;
+
+        items = AllocateZeroPool(sizeof(EntriesIndexItem) * ((UINTN)header->entry_count + 1));
+        if (!items)
+                goto out;
+
+        pos = sizeof(EntriesIndexHeader);
+        for (i = 0; i < header->entry_count; i++) {
+                EntriesIndexRecord *record;
+                CHAR16 *str, *end;
+                UINTN k;
+
+                if (len - pos < sizeof(EntriesIndexRecord))
+                        goto out;
+                record = (EntriesIndexRecord *)(content + pos);
+                if (record->size < sizeof(EntriesIndexRecord) || record->size > len - pos || (record->size & 7))
+                        goto out;
+
+                str = (CHAR16 *)(record + 1);
+                end = (CHAR16 *)((CHAR8 *)record + record->size);
+                for (k = 0; k < INDEX_STRINGS_MAX; k++) {
+                        items[i].strings[k] = str;
+                        while (str < end && *str)
+                                str++;
+                        if (str == end)
+                                goto out;
+                        str++;
+                }
+
+                items[i].record = record;
+                pos += record->size;
+        }
+
+        /* every entry file needs to be in the index, unmodified */
+        next = 0;
+        found = 0;
+        for (;;) {
+                CHAR16 buf[256];
+                UINTN bufsize;
+                EFI_FILE_INFO *f;
+                EntriesIndexItem *item = NULL;
+                EFI_STATUS err;
+
+                bufsize = sizeof(buf);
+                err = uefi_call_wrapper(entries_dir->Read, 3, entries_dir, &bufsize, buf);
+                if (bufsize == 0 || EFI_ERROR(err))
+                        break;
+
+                f = (EFI_FILE_INFO *) buf;
+                if (!is_entry_file(f))
+                        continue;
+
+                /* the index is written in directory order, try the next record first */
+                if (next < header->entry_count && StriCmp(items[next].strings[INDEX_FILE], f->FileName) == 0)
+                        item = &items[next];
+                else {
+                        for (i = 0; i < header->entry_count; i++) {
+                                if (StriCmp(items[i].strings[INDEX_FILE], f->FileName) == 0) {
+                                        item = &items[i];
+                                        break;
+                                }
+                        }
+                }
+                if (!item || item->seen)
+                        goto out;
+                if (item->record->file_size != f->FileSize)
+                        goto out;
+                if (!index_time_match(item->record, &f->ModificationTime))
+                        goto out;
+
+                item->seen = TRUE;
+                next = (item - items) + 1;
+                found++;
+        }
+        if (found != header->entry_count)
+                goto out;
+
+        for (i = 0; i < header->entry_count; i++) {
+                EntriesIndexItem *item = &items[i];
+                ConfigEntry *entry;
+
+                if (item->record->type != LOADER_EFI && item->record->type != LOADER_LINUX)
+                        continue;
+
+                /* do not add an entry for ourselves */
+                if (item->record->type == LOADER_EFI && StriCmp(item->strings[INDEX_LOADER], loaded_image_path) == 0)
+                        continue;
+
+                entry = arena_alloc_zero(&config->arena, sizeof(ConfigEntry));
+                entry->type = item->record->type;
+                entry->title = index_string(&config->arena, item->strings[INDEX_TITLE]);
+                entry->version = index_string(&config->arena, item->strings[INDEX_VERSION]);
+                entry->machine_id = index_string(&config->arena, item->strings[INDEX_MACHINE_ID]);
+                entry->loader = index_string(&config->arena, item->strings[INDEX_LOADER]);
+                entry->options = index_string(&config->arena, item->strings[INDEX_OPTIONS]);
+                config_entry_add_finish(config, entry, device, item->strings[INDEX_FILE],
+                                        index_string(&config->arena, item->strings[INDEX_INITRD]));
+        }
+        valid = TRUE;
+
+out:
+        FreePool(items);
+        FreePool(content);
+        return valid;
+}
+
+static VOID config_load_defaults(Config *config, EFI_FILE *root_dir) {
         EFI_STATUS err;
         CHAR8 *content = NULL;
         UINTN sec;
         UINTN len;
-        UINTN i;
+        UINT64 usec;
 
+        usec = time_usec();
         len = file_read(root_dir, L"\\loader\\loader.conf", &content);
+        trace_add(TRACE_CONFIG_READ, usec, len);
         if (len > 0)
                 config_defaults_load_from_file(config, content);
         FreePool(content);
@@ -1431,10 +3611,28 @@ static VOID config_load(Config *config, EFI_HANDLE *device, EFI_FILE *root_dir,
                 config->timeout_sec = sec;
         } else
                 config->timeout_sec_efivar = -1;
+}
+
+static VOID config_load(Config *config, EFI_HANDLE *device, EFI_FILE *root_dir, CHAR16 *loaded_image_path) {
+        EFI_FILE_HANDLE entries_dir;
+        EFI_STATUS err;
+        UINT64 load_usec;
+        UINT64 usec;
 
+        load_usec = time_usec();
         err = uefi_call_wrapper(root_dir->Open, 5, root_dir, &entries_dir, L"\\loader\\entries", EFI_FILE_MODE_READ, 0);
         if (EFI_ERROR(err) == EFI_SUCCESS) {
-                for (;;) {
+                BOOLEAN indexed;
+
+                usec = time_usec();
+                indexed = config_load_index(config, device, root_dir, entries_dir, loaded_image_path);
+                trace_add(TRACE_ENTRIES_INDEX, usec, indexed);
+
+                /* no usable index, read all files */
+                if (!indexed)
+                        uefi_call_wrapper(entries_dir->SetPosition, 2, entries_dir, 0);
+
+                while (!indexed) {
                         CHAR16 buf[256];
                         UINTN bufsize;
                         EFI_FILE_INFO *f;
@@ -1447,17 +3645,12 @@ static VOID config_load(Config *config, EFI_HANDLE *device, EFI_FILE *root_dir,
                                 break;
 
                         f = (EFI_FILE_INFO *) buf;
-                        if (f->FileName[0] == '.')
-                                continue;
-                        if (f->Attribute & EFI_FILE_DIRECTORY)
-                                continue;
-                        len = StrLen(f->FileName);
-                        if (len < 6)
-                                continue;
-                        if (StriCmp(f->FileName + len - 5, L".conf") != 0)
+                        if (!is_entry_file(f))
                                 continue;
 
+                        usec = time_usec();
                         len = file_read(entries_dir, f->FileName, &content);
+                        trace_add(TRACE_ENTRY_READ, usec, len);
                         if (len > 0)
                                 config_entry_add_from_file(config, device, f->FileName, content, loaded_image_path);
                         FreePool(content);
@@ -1465,25 +3658,11 @@ static VOID config_load(Config *config, EFI_HANDLE *device, EFI_FILE *root_dir,
                 uefi_call_wrapper(entries_dir->Close, 1, entries_dir);
         }
 
-        /* sort entries after version number */
-        for (i = 1; i < config->entry_count; i++) {
-                BOOLEAN more;
-                UINTN k;
-
-                more = FALSE;
-                for (k = 0; k < config->entry_count - i; k++) {
-                        ConfigEntry *entry;
-
-                        if (str_verscmp(config->entries[k]->file, config->entries[k+1]->file) <= 0)
-                                continue;
-                        entry = config->entries[k];
-                        config->entries[k] = config->entries[k+1];
-                        config->entries[k+1] = entry;
-                        more = TRUE;
-                }
-                if (!more)
-                        break;
-        }
+        usec = time_usec();
+        config_sort_entries(config);
+        trace_add(TRACE_SORT, usec, config->entry_count);
+
+        trace_add(TRACE_CONFIG_LOAD, load_usec, config->entry_count);
 }
 
 static VOID config_default_entry_select(Config *config) {
@@ -1567,200 +3746,492 @@ static VOID config_default_entry_select(Config *config) {
         config->idx_default = config->entry_count-1;
 }
 
+/*
+ * Without a menu, the entry named by LoaderEntryOneShot or LoaderEntryDefault
+ * is booted directly, and only its own file needs to be read.
+ */
+static BOOLEAN config_load_fast(Config *config, EFI_HANDLE *device, EFI_FILE *root_dir, CHAR16 *loaded_image_path) {
+        CHAR16 *var = NULL;
+        CHAR16 *name = NULL;
+        CHAR16 *path = NULL;
+        CHAR8 *content = NULL;
+        BOOLEAN oneshot = TRUE;
+        BOOLEAN found = FALSE;
+        UINTN len;
+        UINTN i;
+        UINT64 usec;
+
+        usec = time_usec();
+        if (efivar_get(L"LoaderEntryOneShot", &var) != EFI_SUCCESS) {
+                oneshot = FALSE;
+                if (efivar_get(L"LoaderEntryDefault", &var) != EFI_SUCCESS)
+                        goto out;
+        }
+
+        /* only plain file names */
+        if (var[0] == '\0')
+                goto out;
+        for (i = 0; var[i]; i++)
+                if (var[i] == '\\' || var[i] == '/')
+                        goto out;
+
+        /*
+         * Entry names are stored in lower case, a name with upper case characters
+         * never matches. Check before the entry is added, which consumes the
+         * one-shot options of its machine-id.
+         */
+        name = StrDuplicate(var);
+        if (!name)
+                goto out;
+        StrLwr(name);
+        if (StrCmp(name, var) != 0)
+                goto out;
+        FreePool(name);
+
+        name = PoolPrint(L"%s.conf", var);
+        path = PoolPrint(L"\\loader\\entries\\%s", name);
+        len = file_read(root_dir, path, &content);
+        trace_add(TRACE_ENTRY_READ, usec, len);
+        if (len > 0)
+                config_entry_add_from_file(config, device, name, content, loaded_image_path);
+
+        /* the variable needs to name the entry exactly, like in config_default_entry_select() */
+        if (config->entry_count != 1 || StrCmp(config->entries[0]->file, var) != 0) {
+                config->entry_count = 0;
+                goto out;
+        }
+
+        if (oneshot) {
+                efivar_set(L"LoaderEntryOneShot", NULL, TRUE);
+                config->idx_default_efivar = -1;
+        } else
+                config->idx_default_efivar = 0;
+        config->idx_default = 0;
+        found = TRUE;
+
+out:
+        trace_add(TRACE_FAST_BOOT, usec, found);
+        FreePool(content);
+        FreePool(path);
+        FreePool(name);
+        FreePool(var);
+        return found;
+}
+
+/* mark entries with the same title as non-unique, in a single pass over a hash table of the titles */
+static BOOLEAN config_title_unique(Config *config, INTN *table, UINTN size) {
+        BOOLEAN unique = TRUE;
+        UINTN i;
+
+        for (i = 0; i < size; i++)
+                table[i] = -1;
+
+        for (i = 0; i < config->entry_count; i++) {
+                UINTN h;
+
+                h = title_hash(config->entries[i]->title_show) & (size - 1);
+                for (;;) {
+                        INTN k = table[h];
+
+                        if (k < 0) {
+                                table[h] = i;
+                                break;
+                        }
+
+                        if (StrCmp(config->entries[k]->title_show, config->entries[i]->title_show) == 0) {
+                                unique = FALSE;
+                                config->entries[i]->non_unique = TRUE;
+                                config->entries[k]->non_unique = TRUE;
+                                break;
+                        }
+
+                        h = (h + 1) & (size - 1);
+                }
+        }
+
+        return unique;
+}
+
 /* generate a unique title, avoiding non-distinguishable menu entries */
 static VOID config_title_generate(Config *config) {
+        INTN *table;
+        UINTN size;
         UINTN i, k;
-        BOOLEAN unique;
 
         /* set title */
         for (i = 0; i < config->entry_count; i++) {
                 CHAR16 *title;
 
-                FreePool(config->entries[i]->title_show);
                 title = config->entries[i]->title;
                 if (!title)
                         title = config->entries[i]->file;
-                config->entries[i]->title_show = StrDuplicate(title);
+                config->entries[i]->title_show = title;
         }
 
-        unique = TRUE;
-        for (i = 0; i < config->entry_count; i++) {
-                for (k = 0; k < config->entry_count; k++) {
-                        if (i == k)
-                                continue;
-                        if (StrCmp(config->entries[i]->title_show, config->entries[k]->title_show) != 0)
-                                continue;
-
-                        unique = FALSE;
-                        config->entries[i]->non_unique = TRUE;
-                        config->entries[k]->non_unique = TRUE;
-                }
-        }
-        if (unique)
+        /* keep the hash table at most half full */
+        size = 16;
+        while (size < config->entry_count * 2)
+                size *= 2;
+        table = AllocatePool(size * sizeof(INTN));
+        if (!table)
                 return;
 
+        if (config_title_unique(config, table, size))
+                goto out;
+
         /* add version to non-unique titles */
         for (i = 0; i < config->entry_count; i++) {
-                CHAR16 *s;
-
                 if (!config->entries[i]->non_unique)
                         continue;
                 if (!config->entries[i]->version)
                         continue;
 
-                s = PoolPrint(L"%s (%s)", config->entries[i]->title_show, config->entries[i]->version);
-                FreePool(config->entries[i]->title_show);
-                config->entries[i]->title_show = s;
+                config->entries[i]->title_show = arena_strcat(&config->arena, config->entries[i]->title_show,
+                                                              L" (", config->entries[i]->version, L")", NULL);
                 config->entries[i]->non_unique = FALSE;
         }
 
-        unique = TRUE;
-        for (i = 0; i < config->entry_count; i++) {
-                for (k = 0; k < config->entry_count; k++) {
-                        if (i == k)
-                                continue;
-                        if (StrCmp(config->entries[i]->title_show, config->entries[k]->title_show) != 0)
-                                continue;
-
-                        unique = FALSE;
-                        config->entries[i]->non_unique = TRUE;
-                        config->entries[k]->non_unique = TRUE;
-                }
-        }
-        if (unique)
-                return;
+        if (config_title_unique(config, table, size))
+                goto out;
 
         /* add machine-id to non-unique titles */
         for (i = 0; i < config->entry_count; i++) {
-                CHAR16 *s;
-                CHAR16 *m;
+                CHAR16 m[9];
 
                 if (!config->entries[i]->non_unique)
                         continue;
                 if (!config->entries[i]->machine_id)
                         continue;
 
-                m = StrDuplicate(config->entries[i]->machine_id);
-                m[8] = '\0';
-                s = PoolPrint(L"%s (%s)", config->entries[i]->title_show, m);
-                FreePool(config->entries[i]->title_show);
-                config->entries[i]->title_show = s;
+                /* the first 8 characters of the machine-id */
+                for (k = 0; k < 8 && config->entries[i]->machine_id[k]; k++)
+                        m[k] = config->entries[i]->machine_id[k];
+                m[k] = '\0';
+                config->entries[i]->title_show = arena_strcat(&config->arena, config->entries[i]->title_show,
+                                                              L" (", m, L")", NULL);
                 config->entries[i]->non_unique = FALSE;
-                FreePool(m);
         }
 
-        unique = TRUE;
-        for (i = 0; i < config->entry_count; i++) {
-                for (k = 0; k < config->entry_count; k++) {
-                        if (i == k)
-                                continue;
-                        if (StrCmp(config->entries[i]->title_show, config->entries[k]->title_show) != 0)
-                                continue;
-
-                        unique = FALSE;
-                        config->entries[i]->non_unique = TRUE;
-                        config->entries[k]->non_unique = TRUE;
-                }
-        }
-        if (unique)
-                return;
+        if (config_title_unique(config, table, size))
+                goto out;
 
         /* add file name to non-unique titles */
         for (i = 0; i < config->entry_count; i++) {
-                CHAR16 *s;
-
                 if (!config->entries[i]->non_unique)
                         continue;
-                s = PoolPrint(L"%s (%s)", config->entries[i]->title_show, config->entries[i]->file);
-                FreePool(config->entries[i]->title_show);
-                config->entries[i]->title_show = s;
+                config->entries[i]->title_show = arena_strcat(&config->arena, config->entries[i]->title_show,
+                                                              L" (", config->entries[i]->file, L")", NULL);
                 config->entries[i]->non_unique = FALSE;
         }
+
+out:
+        FreePool(table);
 }
 
 static BOOLEAN config_entry_add_call(Config *config, CHAR16 *title, EFI_STATUS (*call)(void)) {
         ConfigEntry *entry;
 
-        entry = AllocateZeroPool(sizeof(ConfigEntry));
-        entry->title = StrDuplicate(title);
+        entry = arena_alloc_zero(&config->arena, sizeof(ConfigEntry));
+        entry->title = arena_strdup(&config->arena, title);
         entry->call = call;
         entry->no_autoselect = TRUE;
         config_add_entry(config, entry);
         return TRUE;
 }
 
-static BOOLEAN config_entry_add_loader(Config *config, EFI_HANDLE *device, EFI_FILE *root_dir, CHAR16 *loaded_image_path,
-                                       CHAR16 *file, CHAR16 *title, CHAR16 *loader) {
-        EFI_FILE_HANDLE handle;
-        EFI_STATUS err;
+static VOID config_entry_add_loader(Config *config, EFI_HANDLE *device, CHAR16 *file, CHAR16 *title, CHAR16 *loader) {
         ConfigEntry *entry;
 
-        /* do not add an entry for ourselves */
-        if (loaded_image_path && StriCmp(loader, loaded_image_path) == 0)
-                return FALSE;
-
-        /* check existence */
-        err = uefi_call_wrapper(root_dir->Open, 5, root_dir, &handle, loader, EFI_FILE_MODE_READ, 0);
-        if (EFI_ERROR(err))
-                return FALSE;
-        uefi_call_wrapper(handle->Close, 1, handle);
-
-        entry = AllocateZeroPool(sizeof(ConfigEntry));
-        entry->title = StrDuplicate(title);
+        entry = arena_alloc_zero(&config->arena, sizeof(ConfigEntry));
+        entry->title = arena_strdup(&config->arena, title);
         entry->device = device;
-        entry->loader = StrDuplicate(loader);
-        entry->file = StrDuplicate(file);
+        entry->loader = arena_strdup(&config->arena, loader);
+        entry->file = arena_strdup(&config->arena, file);
         StrLwr(entry->file);
         entry->no_autoselect = TRUE;
         config_add_entry(config, entry);
-        return TRUE;
+
+        /* export identifiers of automatically added entries */
+        if (config->entries_auto)
+                config->entries_auto = arena_strcat(&config->arena, config->entries_auto, L" ", file, NULL);
+        else
+                config->entries_auto = arena_strdup(&config->arena, file);
 }
 
-static VOID config_entry_add_loader_auto(Config *config, EFI_HANDLE *device, EFI_FILE *root_dir, CHAR16 *loaded_image_path,
-                                         CHAR16 *file, CHAR16 *title, CHAR16 *loader) {
-        if (!config_entry_add_loader(config, device, root_dir, loaded_image_path, file, title, loader))
+#define PROBE_WINDOWS   (1 << 0)
+#define PROBE_SHELL     (1 << 1)
+#define PROBE_DEFAULT   (1 << 2)
+#define PROBE_OSX       (1 << 3)
+#define PROBE_ESP       (PROBE_WINDOWS|PROBE_SHELL|PROBE_DEFAULT)
+
+static const struct {
+        UINT8 probe;
+        CHAR16 *file;
+        CHAR16 *title;
+        CHAR16 *loader;
+} auto_loaders[] = {
+        { PROBE_WINDOWS, L"auto-windows",     L"Windows Boot Manager", L"\\EFI\\Microsoft\\Boot\\bootmgfw.efi" },
+        { PROBE_SHELL,   L"auto-efi-shell",   L"EFI Shell",            L"\\shell" MACHINE_TYPE_NAME ".efi" },
+        { PROBE_DEFAULT, L"auto-efi-default", L"EFI Default Loader",   L"\\EFI\\BOOT\\BOOT" MACHINE_TYPE_NAME ".efi" },
+        { PROBE_OSX,     L"auto-osx",         L"OS X",                 L"\\System\\Library\\CoreServices\\boot.efi" },
+};
+
+/*
+ * The results of the probes for the well-known loaders are stored per volume
+ * in an EFI variable. A volume is identified by a hash of its device path; as
+ * long as the media id and size of its block device match, which are taken
+ * from the handle database without any disk I/O, the volume is not opened
+ * again. Records of volumes which are not present are kept, so the variable
+ * is only written when a volume is new or has changed. Loaders added to a
+ * known volume are not noticed: the cache is dropped when an automatically
+ * added entry fails to load, and by "gummiboot install", "update" and
+ * "remove".
+ */
+#define PROBE_CACHE_VERSION 3
+#define PROBE_CACHE_SIZE 4096
+
+typedef struct {
+        UINT32 version;
+        UINT32 size;
+} ProbeCacheHeader;
+
+typedef struct {
+        UINT64 path_hash;
+        UINT64 last_block;
+        UINT32 media_id;
+        UINT32 block_size;
+        UINT8 probed;
+        UINT8 found;
+        UINT8 seen;             /* present in this boot, always written as 0 */
+        UINT8 reserved[5];
+} ProbeCacheRecord;
+
+typedef struct {
+        CHAR8 *old;
+        UINTN old_size;
+        CHAR8 *buf;
+        UINTN size;
+        UINTN hits;
+} ProbeCache;
+
+static VOID probe_cache_load(ProbeCache *cache) {
+        ProbeCacheHeader *header;
+
+        ZeroMem(cache, sizeof(ProbeCache));
+        cache->buf = AllocateZeroPool(PROBE_CACHE_SIZE);
+        cache->size = sizeof(ProbeCacheHeader);
+        if (!cache->buf)
                 return;
+        header = (ProbeCacheHeader *)cache->buf;
+        header->version = PROBE_CACHE_VERSION;
 
-        /* export identifiers of automatically added entries */
-        if (config->entries_auto) {
-                CHAR16 *s;
+        if (efivar_get_raw(&loader_guid, L"LoaderProbeCache", &cache->old, &cache->old_size) != EFI_SUCCESS)
+                return;
+
+        header = (ProbeCacheHeader *)cache->old;
+        if (cache->old_size < sizeof(ProbeCacheHeader) || cache->old_size > PROBE_CACHE_SIZE ||
+            header->version != PROBE_CACHE_VERSION || header->size != cache->old_size ||
+            (cache->old_size - sizeof(ProbeCacheHeader)) % sizeof(ProbeCacheRecord) != 0) {
+                FreePool(cache->old);
+                cache->old = NULL;
+                cache->old_size = 0;
+                return;
+        }
+
+        /* the records are updated in place */
+        CopyMem(cache->buf, cache->old, cache->old_size);
+        cache->size = cache->old_size;
+}
+
+static ProbeCacheRecord *probe_cache_find(ProbeCache *cache, UINT64 path_hash) {
+        UINTN pos;
+
+        if (!cache->buf)
+                return NULL;
+
+        for (pos = sizeof(ProbeCacheHeader); pos < cache->size; pos += sizeof(ProbeCacheRecord)) {
+                ProbeCacheRecord *record = (ProbeCacheRecord *)(cache->buf + pos);
+
+                if (record->path_hash == path_hash)
+                        return record;
+        }
+
+        return NULL;
+}
 
-                s = PoolPrint(L"%s %s", config->entries_auto, file);
-                FreePool(config->entries_auto);
-                config->entries_auto = s;
+static ProbeCacheRecord *probe_cache_add(ProbeCache *cache) {
+        ProbeCacheRecord *record;
+
+        if (!cache->buf)
+                return NULL;
+
+        /* when full, drop the volumes which are not present */
+        if (cache->size + sizeof(ProbeCacheRecord) > PROBE_CACHE_SIZE) {
+                UINTN pos;
+                UINTN size = sizeof(ProbeCacheHeader);
+
+                for (pos = sizeof(ProbeCacheHeader); pos < cache->size; pos += sizeof(ProbeCacheRecord)) {
+                        if (!((ProbeCacheRecord *)(cache->buf + pos))->seen)
+                                continue;
+                        if (pos != size)
+                                CopyMem(cache->buf + size, cache->buf + pos, sizeof(ProbeCacheRecord));
+                        size += sizeof(ProbeCacheRecord);
+                }
+                cache->size = size;
+                if (cache->size + sizeof(ProbeCacheRecord) > PROBE_CACHE_SIZE)
+                        return NULL;
+        }
+
+        record = (ProbeCacheRecord *)(cache->buf + cache->size);
+        ZeroMem(record, sizeof(ProbeCacheRecord));
+        cache->size += sizeof(ProbeCacheRecord);
+        return record;
+}
+
+static UINT64 device_path_hash(EFI_DEVICE_PATH *path, UINTN size) {
+        UINT8 *p = (UINT8 *)path;
+        UINT64 h = 14695981039346656037ULL;
+        UINTN i;
+
+        /* FNV-1a */
+        for (i = 0; i < size; i++) {
+                h ^= p[i];
+                h *= 1099511628211ULL;
+        }
+        return h;
+}
+
+/* probe the well-known loaders on a volume, or take the results from the cache */
+static UINT8 probe_volume(ProbeCache *cache, EFI_HANDLE *device, EFI_FILE *root_dir, CHAR16 *loaded_image_path, UINT8 probes) {
+        ProbeCacheRecord key = {};
+        ProbeCacheRecord *record = NULL;
+        EFI_DEVICE_PATH *path;
+        EFI_BLOCK_IO *block_io;
+        UINT8 probed = 0;
+        UINT8 found = 0;
+        UINT8 need;
+        UINTN i;
+
+        path = DevicePathFromHandle(device);
+        if (path && uefi_call_wrapper(BS->HandleProtocol, 3, device, &BlockIoProtocol, (VOID **)&block_io) == EFI_SUCCESS) {
+                key.path_hash = device_path_hash(path, DevicePathSize(path));
+                key.media_id = block_io->Media->MediaId;
+                key.last_block = block_io->Media->LastBlock;
+                key.block_size = block_io->Media->BlockSize;
+                record = probe_cache_find(cache, key.path_hash);
+                if (!record)
+                        record = probe_cache_add(cache);
+        }
+
+        /* the results of an earlier probe, if the volume did not change since */
+        if (record &&
+            record->media_id == key.media_id &&
+            record->last_block == key.last_block &&
+            record->block_size == key.block_size) {
+                probed = record->probed;
+                found = record->found & record->probed;
+        }
+
+        need = probes & ~probed;
+        if (need) {
+                EFI_FILE *root = root_dir;
+
+                if (!root)
+                        root = LibOpenRoot(device);
+                if (!root)
+                        return 0;
+
+                for (i = 0; i < ELEMENTSOF(auto_loaders); i++) {
+                        EFI_FILE_HANDLE handle;
+                        EFI_STATUS err;
+                        UINT64 usec;
+
+                        if (!(need & auto_loaders[i].probe))
+                                continue;
+
+                        usec = time_usec();
+                        err = uefi_call_wrapper(root->Open, 5, root, &handle, auto_loaders[i].loader, EFI_FILE_MODE_READ, 0);
+                        trace_add(TRACE_AUTO_PROBE, usec, !EFI_ERROR(err));
+                        if (EFI_ERROR(err))
+                                continue;
+                        uefi_call_wrapper(handle->Close, 1, handle);
+                        found |= auto_loaders[i].probe;
+                }
+                probed |= need;
+
+                if (root != root_dir)
+                        uefi_call_wrapper(root->Close, 1, root);
         } else
-                config->entries_auto = StrDuplicate(file);
+                cache->hits++;
+
+        if (record) {
+                *record = key;
+                record->probed = probed;
+                record->found = found;
+                record->seen = TRUE;
+        }
+
+        /* do not add an entry for ourselves */
+        for (i = 0; i < ELEMENTSOF(auto_loaders); i++)
+                if (loaded_image_path && StriCmp(auto_loaders[i].loader, loaded_image_path) == 0)
+                        found &= ~auto_loaders[i].probe;
+
+        return found & probes;
+}
+
+/* write the cache only if something changed, it is a non-volatile variable */
+static VOID probe_cache_write(ProbeCache *cache) {
+        if (cache->buf) {
+                UINTN pos;
+
+                for (pos = sizeof(ProbeCacheHeader); pos < cache->size; pos += sizeof(ProbeCacheRecord))
+                        ((ProbeCacheRecord *)(cache->buf + pos))->seen = FALSE;
+                ((ProbeCacheHeader *)cache->buf)->size = cache->size;
+                if (cache->size != cache->old_size || CompareMem(cache->buf, cache->old, cache->size) != 0)
+                        efivar_set_raw(&loader_guid, L"LoaderProbeCache", cache->buf, cache->size, TRUE);
+        }
+
+        FreePool(cache->buf);
+        FreePool(cache->old);
+}
+
+static VOID config_entry_add_auto(Config *config, EFI_HANDLE *device, UINT8 found) {
+        UINTN i;
+
+        for (i = 0; i < ELEMENTSOF(auto_loaders); i++)
+                if (found & auto_loaders[i].probe)
+                        config_entry_add_loader(config, device, auto_loaders[i].file, auto_loaders[i].title,
+                                                auto_loaders[i].loader);
 }
 
-static VOID config_entry_add_osx(Config *config) {
+static VOID config_entry_add_osx(Config *config, ProbeCache *cache) {
         EFI_STATUS err;
         UINTN handle_count = 0;
         EFI_HANDLE *handles = NULL;
+        UINT64 usec;
 
+        usec = time_usec();
         err = LibLocateHandle(ByProtocol, &FileSystemProtocol, NULL, &handle_count, &handles);
         if (EFI_ERROR(err) == EFI_SUCCESS) {
                 UINTN i;
 
-                for (i = 0; i < handle_count; i++) {
-                        EFI_FILE *root;
-
-                        root = LibOpenRoot(handles[i]);
-                        if (!root)
-                                continue;
-                        config_entry_add_loader_auto(config, handles[i], root, NULL, L"auto-osx", L"OS X",
-                                                     L"\\System\\Library\\CoreServices\\boot.efi");
-                        uefi_call_wrapper(root->Close, 1, root);
-                }
+                for (i = 0; i < handle_count; i++)
+                        config_entry_add_auto(config, handles[i], probe_volume(cache, handles[i], NULL, NULL, PROBE_OSX));
 
                 FreePool(handles);
         }
+        trace_add(TRACE_AUTO_OSX, usec, handle_count);
 }
 
-static EFI_STATUS image_start(EFI_HANDLE parent_image, const Config *config, const ConfigEntry *entry) {
+static EFI_STATUS image_start(EFI_HANDLE parent_image, const Config *config, const ConfigEntry *entry,
+                              ImageReader *reader) {
         EFI_STATUS err;
         EFI_HANDLE image;
         EFI_DEVICE_PATH *path;
         CHAR16 *options;
+        UINT64 usec;
+        UINTN n;
+        UINTN preloaded;
 
         path = FileDevicePath(entry->device, entry->loader);
         if (!path) {
@@ -1769,7 +4240,27 @@ static EFI_STATUS image_start(EFI_HANDLE parent_image, const Config *config, con
                 return EFI_INVALID_PARAMETER;
         }
 
-        err = uefi_call_wrapper(BS->LoadImage, 6, FALSE, parent_image, path, NULL, 0, &image);
+        /* the menu read in between key presses, record the span from its first to its last read */
+        image_reader_select(reader, entry);
+        preloaded = reader->pos;
+        if (preloaded > 0)
+                trace_add_range(TRACE_IMAGE_PRELOAD, reader->start_usec, reader->end_usec, preloaded / 1024);
+
+        /* read the image, or what the menu did not get to */
+        usec = time_usec();
+        while (image_reader_pending(reader))
+                image_reader_step(reader, config->read_chunk > 0 ? config->read_chunk : IMAGE_READ_CHUNK);
+        if (reader->buf && reader->size > preloaded)
+                trace_add(TRACE_IMAGE_READ, usec, (reader->size - preloaded) / 1024);
+
+        /* the firmware reads the file itself, if we could not */
+        usec = time_usec();
+        if (reader->buf)
+                err = uefi_call_wrapper(BS->LoadImage, 6, FALSE, parent_image, path, reader->buf, reader->size, &image);
+        else
+                err = uefi_call_wrapper(BS->LoadImage, 6, FALSE, parent_image, path, NULL, 0, &image);
+        image_reader_drop(reader);
+        trace_add(TRACE_LOAD_IMAGE, usec, preloaded > 0);
         if (EFI_ERROR(err)) {
                 Print(L"Error loading %s: %r", entry->loader, err);
                 uefi_call_wrapper(BS->Stall, 1, 3 * 1000 * 1000);
@@ -1797,6 +4288,12 @@ static EFI_STATUS image_start(EFI_HANDLE parent_image, const Config *config, con
         }
 
         efivar_set_time_usec(L"LoaderTimeExecUSec", 0);
+        usec = time_usec();
+        n = efivar_flush();
+        trace_add(TRACE_EFIVAR_FLUSH, usec, n);
+        trace_add(TRACE_START_IMAGE, time_usec(), 0);
+        trace_export();
+        efivar_flush();
         err = uefi_call_wrapper(BS->StartImage, 3, image, NULL, NULL);
 out_unload:
         uefi_call_wrapper(BS->UnloadImage, 1, image);
@@ -1829,32 +4326,123 @@ static EFI_STATUS reboot_into_firmware(VOID) {
 }
 
 static VOID config_free(Config *config) {
+        FreePool(config->options_edit);
+        arena_free(&config->arena);
+}
+
+/* add the well-known loaders to the end of the list, if they exist */
+static VOID config_load_auto(Config *config, EFI_HANDLE *device, EFI_FILE *root_dir, CHAR16 *loaded_image_path) {
+        ProbeCache cache;
+        CHAR8 *b;
+        UINTN size;
+        UINT64 usec;
+
+        if (config->entries_auto_loaded)
+                return;
+        config->entries_auto_loaded = TRUE;
+
+        usec = time_usec();
+        probe_cache_load(&cache);
+        config_entry_add_auto(config, device, probe_volume(&cache, device, root_dir, loaded_image_path, PROBE_ESP));
+        config_entry_add_osx(config, &cache);
+        trace_add(TRACE_PROBE_CACHE, usec, cache.hits);
+        probe_cache_write(&cache);
+        efivar_set(L"LoaderEntriesAuto", config->entries_auto, FALSE);
+
+        if (efivar_get_raw(&global_guid, L"OsIndicationsSupported", &b, &size) == EFI_SUCCESS) {
+                UINT64 osind = (UINT64)*b;
+
+                if (osind & EFI_OS_INDICATIONS_BOOT_TO_FW_UI)
+                        config_entry_add_call(config, L"Reboot Into Firmware Interface", reboot_into_firmware);
+                FreePool(b);
+        }
+}
+
+/*
+ * The automatically added entries are never selected by the pattern or as
+ * the last entry. They are only needed to select the default entry, if the
+ * EFI variables name an entry which is not loaded from a file, or if there
+ * is no other entry.
+ */
+static BOOLEAN config_auto_needed(Config *config) {
+        static CHAR16 *vars[] = { L"LoaderEntryOneShot", L"LoaderEntryDefault" };
         UINTN i;
 
-        for (i = 0; i < config->entry_count; i++)
-                config_entry_free(config->entries[i]);
-        FreePool(config->entries);
-        FreePool(config->entry_default_pattern);
-        FreePool(config->options_edit);
-        FreePool(config->entries_auto);
+        if (config->entry_count == 0)
+                return TRUE;
+
+        for (i = 0; i < ELEMENTSOF(vars); i++) {
+                CHAR16 *var;
+                BOOLEAN found = FALSE;
+                UINTN k;
+
+                if (efivar_get(vars[i], &var) != EFI_SUCCESS)
+                        continue;
+                for (k = 0; k < config->entry_count; k++) {
+                        if (StrCmp(config->entries[k]->file, var) == 0) {
+                                found = TRUE;
+                                break;
+                        }
+                }
+                FreePool(var);
+                return !found;
+        }
+
+        return FALSE;
+}
+
+/* scan "\loader\entries\*.conf" files and select the default entry */
+static VOID config_load_all(Config *config, EFI_HANDLE *device, EFI_FILE *root_dir, CHAR16 *loaded_image_path) {
+        UINT64 usec;
+
+        config_load(config, device, root_dir, loaded_image_path);
+        if (config_auto_needed(config))
+                config_load_auto(config, device, root_dir, loaded_image_path);
+
+        /* select entry by configured pattern or EFI LoaderDefaultEntry= variable*/
+        usec = time_usec();
+        config_default_entry_select(config);
+        trace_add(TRACE_DEFAULT_SELECT, usec, config->idx_default);
+}
+
+/* the work only needed to show the menu */
+static VOID config_load_menu(Config *config, EFI_HANDLE *device, EFI_FILE *root_dir, CHAR16 *loaded_image_path) {
+        UINT64 usec;
+
+        if (config->title_generated)
+                return;
+
+        config_load_auto(config, device, root_dir, loaded_image_path);
+
+        usec = time_usec();
+        config_title_generate(config);
+        trace_add(TRACE_TITLE_GENERATE, usec, config->entry_count);
+        config->title_generated = TRUE;
 }
 
 EFI_STATUS EFIAPI efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table) {
         CHAR16 *s;
-        CHAR8 *b;
-        UINTN size;
         EFI_LOADED_IMAGE *loaded_image;
         EFI_FILE *root_dir;
         CHAR16 *loaded_image_path;
         EFI_DEVICE_PATH *device_path;
         EFI_STATUS err;
         Config config;
+        ImageReader reader;
         UINT64 init_usec;
+        UINT64 usec;
         BOOLEAN menu = FALSE;
+        BOOLEAN fast = FALSE;
 
         InitializeLib(image, sys_table);
         init_usec = time_usec();
         efivar_set_time_usec(L"LoaderTimeInitUSec", init_usec);
+        if (timer_freq_read() > 0) {
+                efivar_set(L"LoaderTimerSource", timer_source_names[timer.source], FALSE);
+                s = PoolPrint(L"%ld", timer.freq);
+                efivar_set(L"LoaderTimerFreqHz", s, FALSE);
+                FreePool(s);
+        }
         efivar_set(L"LoaderInfo", L"gummiboot " stringify(VERSION), FALSE);
         s = PoolPrint(L"%s %d.%02d", ST->FirmwareVendor, ST->FirmwareRevision >> 16, ST->FirmwareRevision & 0xffff);
         efivar_set(L"LoaderFirmwareInfo", s, FALSE);
@@ -1868,6 +4456,7 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table) {
         if (EFI_ERROR(err)) {
                 Print(L"Error getting a LoadedImageProtocol handle: %r ", err);
                 uefi_call_wrapper(BS->Stall, 1, 3 * 1000 * 1000);
+                efivar_flush();
                 return err;
         }
 
@@ -1905,6 +4494,7 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table) {
         if (!root_dir) {
                 Print(L"Unable to open root directory: %r ", err);
                 uefi_call_wrapper(BS->Stall, 1, 3 * 1000 * 1000);
+                efivar_flush();
                 return EFI_LOAD_ERROR;
         }
 
@@ -1912,38 +4502,10 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table) {
         loaded_image_path = DevicePathToStr(loaded_image->FilePath);
         efivar_set(L"LoaderImageIdentifier", loaded_image_path, FALSE);
 
-        /* scan "\loader\entries\*.conf" files */
+        /* the defaults from \loader\loader.conf and EFI variables */
         ZeroMem(&config, sizeof(Config));
-        config_load(&config, loaded_image->DeviceHandle, root_dir, loaded_image_path);
-
-        /* if we find some well-known loaders, add them to the end of the list */
-        config_entry_add_loader_auto(&config, loaded_image->DeviceHandle, root_dir, loaded_image_path,
-                                     L"auto-windows", L"Windows Boot Manager", L"\\EFI\\Microsoft\\Boot\\bootmgfw.efi");
-        config_entry_add_loader_auto(&config, loaded_image->DeviceHandle, root_dir, loaded_image_path,
-                                     L"auto-efi-shell", L"EFI Shell", L"\\shellx64.efi");
-        config_entry_add_loader_auto(&config, loaded_image->DeviceHandle, root_dir, loaded_image_path,
-                                     L"auto-efi-default", L"EFI Default Loader", L"\\EFI\\BOOT\\BOOTX64.EFI");
-        config_entry_add_osx(&config);
-        efivar_set(L"LoaderEntriesAuto", config.entries_auto, FALSE);
-
-        if (efivar_get_raw(&global_guid, L"OsIndicationsSupported", &b, &size) == EFI_SUCCESS) {
-                UINT64 osind = (UINT64)*b;
-
-                if (osind & EFI_OS_INDICATIONS_BOOT_TO_FW_UI)
-                        config_entry_add_call(&config, L"Reboot Into Firmware Interface", reboot_into_firmware);
-                FreePool(b);
-        }
-
-        config_title_generate(&config);
-
-        /* select entry by configured pattern or EFI LoaderDefaultEntry= variable*/
-        config_default_entry_select(&config);
-
-        if (config.entry_count == 0) {
-                Print(L"No loader found. Configuration files in \\loader\\entries\\*.conf are needed.");
-                uefi_call_wrapper(BS->Stall, 1, 3 * 1000 * 1000);
-                goto out;
-        }
+        ZeroMem(&reader, sizeof(ImageReader));
+        config_load_defaults(&config, root_dir);
 
         /* show menu when key is pressed or timeout is set */
         if (config.timeout_sec == 0) {
@@ -1954,14 +4516,32 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table) {
         } else
                 menu = TRUE;
 
+        /* without a menu, try to load only the selected entry */
+        if (!menu)
+                fast = config_load_fast(&config, loaded_image->DeviceHandle, root_dir, loaded_image_path);
+        if (!fast)
+                config_load_all(&config, loaded_image->DeviceHandle, root_dir, loaded_image_path);
+
+        if (config.entry_count == 0) {
+                Print(L"No loader found. Configuration files in \\loader\\entries\\*.conf are needed.");
+                uefi_call_wrapper(BS->Stall, 1, 3 * 1000 * 1000);
+                goto out;
+        }
+
         for (;;) {
                 ConfigEntry *entry;
 
                 entry = config.entries[config.idx_default];
                 if (menu) {
-                        efivar_set_time_usec(L"LoaderTimeMenuUSec", 0);
+                        BOOLEAN run;
+
+                        config_load_menu(&config, loaded_image->DeviceHandle, root_dir, loaded_image_path);
+                        usec = time_usec();
+                        efivar_set_time_usec(L"LoaderTimeMenuUSec", usec);
                         uefi_call_wrapper(BS->SetWatchdogTimer, 4, 0, 0x10000, 0, NULL);
-                        if (!menu_run(&config, &entry, loaded_image_path))
+                        run = menu_run(&config, &entry, loaded_image_path, &reader);
+                        trace_add(TRACE_MENU, usec, run);
+                        if (!run)
                                 break;
 
                         if (entry->call) {
@@ -1974,7 +4554,7 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table) {
                 efivar_set(L"LoaderEntrySelected", entry->file, FALSE);
 
                 uefi_call_wrapper(BS->SetWatchdogTimer, 4, 5 * 60, 0x10000, 0, NULL);
-                err = image_start(image, &config, entry);
+                err = image_start(image, &config, entry, &reader);
 
                 if (err == EFI_ACCESS_DENIED || err == EFI_SECURITY_VIOLATION) {
                         /* Platform is secure boot and requested image isn't
@@ -1987,11 +4567,26 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table) {
                         goto out;
                 }
 
+                /* the probe cache might be stale, and the loader gone */
+                if (StrnCmp(entry->file, L"auto-", 5) == 0)
+                        efivar_set_raw(&loader_guid, L"LoaderProbeCache", NULL, 0, TRUE);
+
+                /* the directly loaded entry failed, load all entries for the menu */
+                if (fast) {
+                        fast = FALSE;
+                        config.entry_count = 0;
+                        config_load_all(&config, loaded_image->DeviceHandle, root_dir, loaded_image_path);
+                        if (config.entry_count == 0)
+                                break;
+                }
+
                 menu = TRUE;
                 config.timeout_sec = 0;
         }
         err = EFI_SUCCESS;
 out:
+        efivar_flush();
+        image_reader_drop(&reader);
         FreePool(loaded_image_path);
         config_free(&config);
         uefi_call_wrapper(root_dir->Close, 1, root_dir);
@@ -35,7 +35,11 @@
 #include <ctype.h>
 #include <limits.h>
 #include <ftw.h>
+#include <time.h>
 #include <stdbool.h>
+#include <mntent.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
 #include <blkid.h>
 
 #include "efivars.h"
@@ -43,6 +47,8 @@
 #define _stringify(s) #s
 #define stringify(s) _stringify(s)
 
+#define EFI_VENDOR_LOADER ((uint8_t[16]) { 0x4a,0x67,0xb0,0x82,0x0a,0x4c,0x41,0xcf,0xb6,0xc7,0x44,0x0b,0x29,0xbb,0x8c,0x4f })
+
 #define ELEMENTSOF(x) (sizeof(x)/sizeof((x)[0]))
 #define streq(a,b) (strcmp((a),(b)) == 0)
 
@@ -419,6 +425,7 @@ finish:
 static int status_variables(void) {
         int n_options, n_order;
         uint16_t *options = NULL, *order = NULL;
+        char *nv_writes;
         int r, i;
 
         if (!is_efi_boot()) {
@@ -426,6 +433,12 @@ static int status_variables(void) {
                 return 0;
         }
 
+        /* non-volatile variables written by the boot loader during this boot */
+        if (efi_get_variable_string(EFI_VENDOR_LOADER, "LoaderNVWriteCount", &nv_writes) >= 0) {
+                printf("\nBoot loader NV variable writes: %s\n", nv_writes);
+                free(nv_writes);
+        }
+
         printf("\nBoot entries found in EFI variables:\n");
 
         n_options = efi_get_boot_options(&options);
@@ -486,6 +499,340 @@ finish:
         return r;
 }
 
+/* LoaderBootTrace, as exported by the boot loader */
+struct boot_trace_header {
+        uint32_t version;
+        uint32_t count;
+        uint32_t dropped;
+        uint32_t reserved;
+} __attribute__((packed));
+
+struct boot_trace_entry {
+        uint64_t start_usec;
+        uint64_t end_usec;
+        uint32_t event;
+        uint32_t arg;
+} __attribute__((packed));
+
+/* the same numbers as enum trace_event in the boot loader */
+enum {
+        TRACE_EVENT_CONFIG_READ = 1,
+        TRACE_EVENT_ENTRY_READ,
+        TRACE_EVENT_CONFIG_LOAD,
+        TRACE_EVENT_AUTO_PROBE,
+        TRACE_EVENT_AUTO_OSX,
+        TRACE_EVENT_TITLE_GENERATE,
+        TRACE_EVENT_DEFAULT_SELECT,
+        TRACE_EVENT_MENU,
+        TRACE_EVENT_LOAD_IMAGE,
+        TRACE_EVENT_START_IMAGE,
+        TRACE_EVENT_ENTRIES_INDEX,
+        TRACE_EVENT_SORT,
+        TRACE_EVENT_FAST_BOOT,
+        TRACE_EVENT_PROBE_CACHE,
+        TRACE_EVENT_EFIVAR_FLUSH,
+        TRACE_EVENT_IMAGE_READ,
+        TRACE_EVENT_IMAGE_PRELOAD,
+};
+
+static const struct {
+        const char *name;
+        const char *arg;
+        bool rate;      /* arg is in KiB, show the throughput */
+} trace_events[] = {
+        [TRACE_EVENT_CONFIG_READ] =    { "loader.conf read",   "%u bytes" },
+        [TRACE_EVENT_ENTRY_READ] =     { "entry read",         "%u bytes" },
+        [TRACE_EVENT_CONFIG_LOAD] =    { "config load",        "%u entries" },
+        [TRACE_EVENT_AUTO_PROBE] =     { "auto-entry probe",   "found: %u" },
+        [TRACE_EVENT_AUTO_OSX] =       { "OS X probe",         "%u file systems" },
+        [TRACE_EVENT_TITLE_GENERATE] = { "title generation",   "%u entries" },
+        [TRACE_EVENT_DEFAULT_SELECT] = { "default selection",  "index %u" },
+        [TRACE_EVENT_MENU] =           { "menu",               NULL },
+        [TRACE_EVENT_LOAD_IMAGE] =     { "LoadImage",          "preloaded: %u" },
+        [TRACE_EVENT_START_IMAGE] =    { "StartImage",         NULL },
+        [TRACE_EVENT_ENTRIES_INDEX] =  { "entries index",      "used: %u" },
+        [TRACE_EVENT_SORT] =           { "entry sort",         "%u entries" },
+        [TRACE_EVENT_FAST_BOOT] =      { "fast boot",          "used: %u" },
+        [TRACE_EVENT_PROBE_CACHE] =    { "probe cache",        "hits: %u" },
+        [TRACE_EVENT_EFIVAR_FLUSH] =   { "variable flush",     "%u variables" },
+        [TRACE_EVENT_IMAGE_READ] =     { "image read",         "%u KiB",        true },
+        [TRACE_EVENT_IMAGE_PRELOAD] =  { "image preload",      "%u KiB" },
+};
+
+static char *format_usec(char *buf, size_t size, uint64_t usec) {
+        if (usec >= 1000 * 1000)
+                snprintf(buf, size, "%" PRIu64 ".%03" PRIu64 "s", usec / (1000 * 1000), (usec / 1000) % 1000);
+        else if (usec >= 1000)
+                snprintf(buf, size, "%" PRIu64 ".%03" PRIu64 "ms", usec / 1000, usec % 1000);
+        else
+                snprintf(buf, size, "%" PRIu64 "us", usec);
+        return buf;
+}
+
+static char *format_trace_event(char *buf, size_t size, const struct boot_trace_entry *e) {
+        char arg[64];
+
+        if (e->event >= ELEMENTSOF(trace_events) || !trace_events[e->event].name) {
+                snprintf(buf, size, "event %u (%u)", e->event, e->arg);
+                return buf;
+        }
+
+        if (!trace_events[e->event].arg) {
+                snprintf(buf, size, "%s", trace_events[e->event].name);
+                return buf;
+        }
+
+        snprintf(arg, sizeof(arg), trace_events[e->event].arg, e->arg);
+        if (trace_events[e->event].rate && e->end_usec > e->start_usec) {
+                /* bytes per microsecond are MB/s */
+                snprintf(buf, size, "%s (%s, %.1f MB/s)", trace_events[e->event].name, arg,
+                         (double) e->arg * 1024 / (e->end_usec - e->start_usec));
+                return buf;
+        }
+        snprintf(buf, size, "%s (%s)", trace_events[e->event].name, arg);
+        return buf;
+}
+
+static int get_time_usec(const char *name, uint64_t *usec) {
+        char *s;
+        int r;
+
+        r = efi_get_variable_string(EFI_VENDOR_LOADER, name, &s);
+        if (r < 0)
+                return r;
+
+        errno = 0;
+        *usec = strtoull(s, NULL, 10);
+        r = errno != 0 ? -errno : 0;
+        free(s);
+        return r;
+}
+
+static int get_uptime_usec(uint64_t *usec) {
+        FILE *f;
+        double uptime;
+        int r;
+
+        f = fopen("/proc/uptime", "re");
+        if (!f)
+                return -errno;
+
+        r = fscanf(f, "%lf", &uptime) == 1 ? 0 : -EIO;
+        fclose(f);
+        if (r < 0)
+                return r;
+
+        *usec = (uint64_t) (uptime * 1000 * 1000);
+        return 0;
+}
+
+static int get_boot_trace(struct boot_trace_entry **entries, unsigned int *n, unsigned int *dropped) {
+        struct boot_trace_header *h;
+        void *v;
+        size_t size;
+        int r;
+
+        r = efi_get_variable(EFI_VENDOR_LOADER, "LoaderBootTrace", &v, &size);
+        if (r < 0)
+                return r;
+
+        h = v;
+        if (size < sizeof(struct boot_trace_header) || h->version != 1 ||
+            h->count > (size - sizeof(struct boot_trace_header)) / sizeof(struct boot_trace_entry)) {
+                free(v);
+                return -EINVAL;
+        }
+
+        *entries = malloc(h->count * sizeof(struct boot_trace_entry) + 1);
+        if (!*entries) {
+                free(v);
+                return -ENOMEM;
+        }
+        memcpy(*entries, h + 1, h->count * sizeof(struct boot_trace_entry));
+        *n = h->count;
+        *dropped = h->dropped;
+
+        free(v);
+        return 0;
+}
+
+static int cmp_trace_duration(const void *_a, const void *_b) {
+        const struct boot_trace_entry *a = _a, *b = _b;
+        uint64_t da = a->end_usec - a->start_usec;
+        uint64_t db = b->end_usec - b->start_usec;
+
+        if (da > db)
+                return -1;
+        if (da < db)
+                return 1;
+        return a->start_usec < b->start_usec ? -1 : a->start_usec > b->start_usec;
+}
+
+static int status_timing(bool blame) {
+        uint64_t init = 0, menu = 0, exec = 0, uptime = 0;
+        uint64_t menu_duration = 0;
+        struct boot_trace_entry *entries = NULL;
+        unsigned int n = 0, dropped = 0, i;
+        char *source = NULL, *freq = NULL, *nv_writes = NULL;
+        char a[32], b[32], c[256];
+        int r;
+
+        if (!is_efi_boot()) {
+                fprintf(stderr, "Not booted with EFI, no boot loader timing available.\n");
+                return -ENODEV;
+        }
+
+        r = get_time_usec("LoaderTimeInitUSec", &init);
+        if (r < 0) {
+                fprintf(stderr, "Boot loader did not export timestamps.\n");
+                return r;
+        }
+        if (get_time_usec("LoaderTimeExecUSec", &exec) < 0 || exec < init) {
+                fprintf(stderr, "Boot loader did not export the kernel execution timestamp.\n");
+                return -ENODATA;
+        }
+        get_time_usec("LoaderTimeMenuUSec", &menu);
+        get_boot_trace(&entries, &n, &dropped);
+
+        if (blame) {
+                if (n == 0) {
+                        fprintf(stderr, "Boot loader did not export a boot trace.\n");
+                        return -ENODATA;
+                }
+
+                qsort(entries, n, sizeof(struct boot_trace_entry), cmp_trace_duration);
+                for (i = 0; i < n; i++)
+                        printf("%12s %s\n",
+                               format_usec(a, sizeof(a), entries[i].end_usec - entries[i].start_usec),
+                               format_trace_event(c, sizeof(c), &entries[i]));
+                free(entries);
+                return 0;
+        }
+
+        /* the time spent waiting in the menu does not count as loader time */
+        for (i = 0; i < n; i++)
+                if (entries[i].event == TRACE_EVENT_MENU)
+                        menu_duration += entries[i].end_usec - entries[i].start_usec;
+        if (menu_duration == 0 && menu > init && menu < exec)
+                menu_duration = exec - menu;
+
+        printf("Boot loader timing:\n");
+        if (efi_get_variable_string(EFI_VENDOR_LOADER, "LoaderTimerSource", &source) >= 0 &&
+            efi_get_variable_string(EFI_VENDOR_LOADER, "LoaderTimerFreqHz", &freq) >= 0)
+                printf("       Timer: %s, %.3f MHz\n", source, strtoull(freq, NULL, 10) / 1000000.0);
+        if (efi_get_variable_string(EFI_VENDOR_LOADER, "LoaderNVWriteCount", &nv_writes) >= 0)
+                printf("   NV writes: %s\n", nv_writes);
+        printf("    Firmware: %s\n", format_usec(a, sizeof(a), init));
+        printf("      Loader: %s\n", format_usec(a, sizeof(a), exec - init - menu_duration));
+        if (menu_duration > 0)
+                printf("        Menu: %s\n", format_usec(a, sizeof(a), menu_duration));
+        if (get_uptime_usec(&uptime) >= 0)
+                printf("      Kernel: %s (uptime, %s since firmware start)\n",
+                       format_usec(a, sizeof(a), uptime), format_usec(b, sizeof(b), exec + uptime));
+
+        if (n > 0) {
+                printf("\nBoot loader trace:\n");
+                for (i = 0; i < n; i++)
+                        printf("%12s %12s %s\n",
+                               format_usec(a, sizeof(a), entries[i].start_usec),
+                               format_usec(b, sizeof(b), entries[i].end_usec - entries[i].start_usec),
+                               format_trace_event(c, sizeof(c), &entries[i]));
+                if (dropped > 0)
+                        printf("\t%u events not recorded, trace buffer full.\n", dropped);
+        }
+
+        free(source);
+        free(freq);
+        free(nv_writes);
+        free(entries);
+        return 0;
+}
+
+/* Chrome trace-event JSON, as loaded by Perfetto or about:tracing */
+static void print_trace_json_event(const char *name, unsigned int tid, uint64_t ts, uint64_t dur,
+                                   const char *arg_name, uint32_t arg) {
+        printf(",\n    { \"name\": \"%s\", \"cat\": \"boot\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, "
+               "\"ts\": %" PRIu64 ", \"dur\": %" PRIu64,
+               name, tid, ts, dur);
+        if (arg_name)
+                printf(", \"args\": { \"%s\": %u }", arg_name, arg);
+        printf(" }");
+}
+
+static int status_trace_json(void) {
+        static const char *tracks[] = { NULL, "firmware", "loader", "menu", "kernel" };
+        enum { TRACK_FIRMWARE = 1, TRACK_LOADER, TRACK_MENU, TRACK_KERNEL };
+        uint64_t init = 0, menu = 0, exec = 0, uptime = 0;
+        struct boot_trace_entry *entries = NULL;
+        unsigned int n = 0, dropped = 0, i;
+        bool menu_traced = false;
+        int r;
+
+        if (!is_efi_boot()) {
+                fprintf(stderr, "Not booted with EFI, no boot loader timing available.\n");
+                return -ENODEV;
+        }
+
+        r = get_time_usec("LoaderTimeInitUSec", &init);
+        if (r < 0) {
+                fprintf(stderr, "Boot loader did not export timestamps.\n");
+                return r;
+        }
+        if (get_time_usec("LoaderTimeExecUSec", &exec) < 0 || exec < init) {
+                fprintf(stderr, "Boot loader did not export the kernel execution timestamp.\n");
+                return -ENODATA;
+        }
+        get_time_usec("LoaderTimeMenuUSec", &menu);
+        get_boot_trace(&entries, &n, &dropped);
+
+        printf("{\n  \"displayTimeUnit\": \"ms\",\n  \"traceEvents\": [");
+
+        printf("\n    { \"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": { \"name\": \"gummiboot\" } }");
+        for (i = TRACK_FIRMWARE; i < ELEMENTSOF(tracks); i++)
+                printf(",\n    { \"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": { \"name\": \"%s\" } }"
+                       ",\n    { \"name\": \"thread_sort_index\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": { \"sort_index\": %u } }",
+                       i, tracks[i], i, i);
+
+        print_trace_json_event("firmware", TRACK_FIRMWARE, 0, init, NULL, 0);
+        print_trace_json_event("loader", TRACK_LOADER, init, exec - init, NULL, 0);
+
+        /* the finer-grained loader events nest below the loader stage */
+        for (i = 0; i < n; i++) {
+                const char *name = NULL;
+                const char *arg_name = NULL;
+
+                if (entries[i].event < ELEMENTSOF(trace_events))
+                        name = trace_events[entries[i].event].name;
+                if (!name)
+                        name = "unknown";
+                if (entries[i].event < ELEMENTSOF(trace_events) && trace_events[entries[i].event].arg)
+                        arg_name = "arg";
+
+                if (entries[i].event == TRACE_EVENT_MENU) {
+                        print_trace_json_event(name, TRACK_MENU, entries[i].start_usec,
+                                               entries[i].end_usec - entries[i].start_usec, NULL, 0);
+                        menu_traced = true;
+                        continue;
+                }
+
+                /* the preload reads while the menu waits for a key */
+                print_trace_json_event(name, entries[i].event == TRACE_EVENT_IMAGE_PRELOAD ? TRACK_MENU : TRACK_LOADER,
+                                       entries[i].start_usec, entries[i].end_usec - entries[i].start_usec,
+                                       arg_name, entries[i].arg);
+        }
+
+        if (!menu_traced && menu > init && menu < exec)
+                print_trace_json_event("menu", TRACK_MENU, menu, exec - menu, NULL, 0);
+
+        if (get_uptime_usec(&uptime) >= 0)
+                print_trace_json_event("kernel", TRACK_KERNEL, exec, uptime, NULL, 0);
+
+        printf("\n  ]\n}\n");
+
+        free(entries);
+        return 0;
+}
+
 static int compare_product(const char *a, const char *b) {
         size_t x, y;
 
@@ -1159,6 +1506,17 @@ static int remove_binaries(const char *esp_path) {
         if (q < 0 && r == 0)
                 r = q;
 
+        if (asprintf(&p, "%s/loader/entries.idx", esp_path) < 0) {
+                fprintf(stderr, "Out of memory.\n");
+                return -ENOMEM;
+        }
+        if (unlink(p) < 0 && errno != ENOENT) {
+                fprintf(stderr, "Failed to remove %s: %m\n", p);
+                if (r == 0)
+                        r = -errno;
+        }
+        free(p);
+
         q = rmdir_one(esp_path, "loader/entries");
         if (q < 0 && r == 0)
                 r = q;
@@ -1203,6 +1561,446 @@ static int remove_variables(const uint8_t uuid[16], const char *path, bool in_or
         return 0;
 }
 
+/*
+ * \loader\entries.idx, the pre-parsed \loader\entries\*.conf files. The boot
+ * loader only uses it as long as all entry files still match the recorded
+ * names, sizes and modification times, and reads the files otherwise.
+ */
+struct entries_index_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t entry_count;
+        uint32_t size;
+        uint32_t reserved;
+} __attribute__((packed));
+
+struct entries_index_record {
+        uint32_t size;
+        uint32_t type;
+        uint64_t file_size;
+        uint16_t year;
+        uint8_t month;
+        uint8_t day;
+        uint8_t hour;
+        uint8_t minute;
+        uint8_t second;
+        uint8_t reserved;
+} __attribute__((packed));
+
+enum loader_type {
+        LOADER_UNDEFINED,
+        LOADER_EFI,
+        LOADER_LINUX
+};
+
+struct index_buffer {
+        uint8_t *data;
+        size_t size;
+        size_t allocated;
+};
+
+static int index_append(struct index_buffer *b, const void *p, size_t n) {
+        if (b->size + n > b->allocated) {
+                size_t a;
+                uint8_t *d;
+
+                a = (b->size + n) * 2;
+                d = realloc(b->data, a);
+                if (!d)
+                        return -ENOMEM;
+                memset(d + b->allocated, 0, a - b->allocated);
+                b->data = d;
+                b->allocated = a;
+        }
+
+        if (p)
+                memcpy(b->data + b->size, p, n);
+        b->size += n;
+        return 0;
+}
+
+/* the same conversion as the boot loader does, invalid sequences are skipped */
+static int utf8_to_16(const uint8_t *s, uint16_t *c) {
+        uint16_t unichar;
+        int len;
+        int i;
+
+        if (s[0] < 0x80)
+                len = 1;
+        else if ((s[0] & 0xe0) == 0xc0)
+                len = 2;
+        else if ((s[0] & 0xf0) == 0xe0)
+                len = 3;
+        else if ((s[0] & 0xf8) == 0xf0)
+                len = 4;
+        else if ((s[0] & 0xfc) == 0xf8)
+                len = 5;
+        else if ((s[0] & 0xfe) == 0xfc)
+                len = 6;
+        else
+                return -1;
+
+        unichar = s[0] & (0xff >> (len == 1 ? 0 : len + 1));
+        for (i = 1; i < len; i++) {
+                if ((s[i] & 0xc0) != 0x80)
+                        return -1;
+                unichar <<= 6;
+                unichar |= s[i] & 0x3f;
+        }
+
+        *c = unichar;
+        return len;
+}
+
+/* convert a path like the boot loader does: a leading backslash, backslashes as separators */
+static char *path_to_efi(const char *s) {
+        char *str;
+        size_t n = 0;
+
+        str = malloc(strlen(s) + 2);
+        if (!str)
+                return NULL;
+
+        str[n++] = '\\';
+        for (; *s; s++) {
+                char c = *s == '/' ? '\\' : *s;
+
+                if (c == '\\' && str[n-1] == '\\')
+                        continue;
+                str[n++] = c;
+        }
+        str[n] = '\0';
+        return str;
+}
+
+/* append as NUL-terminated UTF-16 */
+static int index_append_string(struct index_buffer *b, const char *s) {
+        size_t len;
+        uint16_t *str;
+        size_t n = 0;
+        size_t i = 0;
+        int r;
+
+        if (!s)
+                s = "";
+
+        len = strlen(s);
+        str = malloc((len + 1) * sizeof(uint16_t));
+        if (!str)
+                return -ENOMEM;
+
+        while (i < len) {
+                int l;
+
+                l = utf8_to_16((const uint8_t *)s + i, str + n);
+                if (l <= 0) {
+                        i++;
+                        continue;
+                }
+                i += l;
+                n++;
+        }
+        str[n++] = '\0';
+
+        r = index_append(b, str, n * sizeof(uint16_t));
+        free(str);
+        return r;
+}
+
+static char *strappend_space(char *a, const char *prefix, const char *b) {
+        char *s;
+
+        if (asprintf(&s, "%s%s%s%s", a ? a : "", a ? " " : "", prefix, b) < 0)
+                return NULL;
+        free(a);
+        return s;
+}
+
+/*
+ * FAT stores local time. The vfat driver converts with the offset given by the
+ * tz=UTC or time_offset= mount options, or else with the kernel's time zone,
+ * which is not the one of this process. Return the seconds it subtracts from
+ * UTC, so the index carries the same time the boot loader reads.
+ */
+static long fat_tz_offset(const char *esp_path) {
+        struct timezone tz = {};
+        struct stat st;
+        struct mntent *m;
+        FILE *f;
+        long offset;
+
+        /* glibc no longer returns the kernel's time zone */
+        if (syscall(SYS_gettimeofday, NULL, &tz) < 0)
+                tz.tz_minuteswest = 0;
+        offset = (long) tz.tz_minuteswest * 60;
+
+        if (stat(esp_path, &st) < 0)
+                return offset;
+
+        f = setmntent("/proc/self/mounts", "re");
+        if (!f)
+                return offset;
+
+        while ((m = getmntent(f))) {
+                struct stat mst;
+                char *o;
+
+                if (!streq(m->mnt_type, "vfat"))
+                        continue;
+                if (stat(m->mnt_dir, &mst) < 0 || mst.st_dev != st.st_dev)
+                        continue;
+
+                if ((o = hasmntopt(m, "time_offset")) && o[strlen("time_offset")] == '=')
+                        offset = -strtol(o + strlen("time_offset="), NULL, 10) * 60;
+                else if ((o = hasmntopt(m, "tz")) && strncmp(o, "tz=UTC", 6) == 0)
+                        offset = 0;
+        }
+
+        endmntent(f);
+        return offset;
+}
+
+/* parse an entry file like the boot loader does, and append its record */
+static int index_append_entry(struct index_buffer *b, const char *name, char *content, const struct stat *st,
+                              long tz_offset) {
+        struct entries_index_record record = {};
+        char *title = NULL, *version = NULL, *machine_id = NULL;
+        char *loader = NULL, *initrd = NULL, *options = NULL;
+        char *line, *next;
+        size_t start;
+        time_t t;
+        struct tm tm;
+        int r = -ENOMEM;
+
+        for (line = content; line; line = next) {
+                char *key, *value, *end;
+
+                next = line + strcspn(line, "\n\r");
+                if (*next)
+                        *next++ = '\0';
+                else
+                        next = NULL;
+
+                line += strspn(line, " \t");
+                end = line + strlen(line);
+                while (end > line && strchr(" \t", end[-1]))
+                        end--;
+                *end = '\0';
+
+                if (line[0] == '\0' || line[0] == '#')
+                        continue;
+
+                key = line;
+                value = key + strcspn(key, " \t");
+                if (*value == '\0')
+                        continue;
+                *value++ = '\0';
+                value += strspn(value, " \t");
+
+                if (streq(key, "title")) {
+                        title = value;
+                } else if (streq(key, "version")) {
+                        version = value;
+                } else if (streq(key, "machine-id")) {
+                        machine_id = value;
+                } else if (streq(key, "linux") || streq(key, "efi")) {
+                        record.type = streq(key, "linux") ? LOADER_LINUX : LOADER_EFI;
+                        free(loader);
+                        loader = path_to_efi(value);
+                        if (!loader)
+                                goto finish;
+                } else if (streq(key, "initrd")) {
+                        char *p;
+
+                        p = path_to_efi(value);
+                        if (!p)
+                                goto finish;
+                        initrd = strappend_space(initrd, "initrd=", p);
+                        free(p);
+                        if (!initrd)
+                                goto finish;
+                } else if (streq(key, "options")) {
+                        options = strappend_space(options, "", value);
+                        if (!options)
+                                goto finish;
+                }
+        }
+
+        record.file_size = st->st_size;
+        t = st->st_mtime - tz_offset;
+        gmtime_r(&t, &tm);
+        record.year = tm.tm_year + 1900;
+        record.month = tm.tm_mon + 1;
+        record.day = tm.tm_mday;
+        record.hour = tm.tm_hour;
+        record.minute = tm.tm_min;
+        record.second = tm.tm_sec & ~1;
+
+        start = b->size;
+        if (index_append(b, &record, sizeof(record)) < 0 ||
+            index_append_string(b, name) < 0 ||
+            index_append_string(b, title) < 0 ||
+            index_append_string(b, version) < 0 ||
+            index_append_string(b, machine_id) < 0 ||
+            index_append_string(b, loader) < 0 ||
+            index_append_string(b, initrd) < 0 ||
+            index_append_string(b, options) < 0 ||
+            index_append(b, NULL, (8 - (b->size - start) % 8) % 8) < 0)
+                goto finish;
+
+        ((struct entries_index_record *)(b->data + start))->size = b->size - start;
+        r = 0;
+
+finish:
+        free(loader);
+        free(initrd);
+        free(options);
+        return r;
+}
+
+static int install_entries_index(const char *esp_path) {
+        struct index_buffer b = {};
+        struct entries_index_header *h;
+        char *p = NULL, *t = NULL, *q = NULL;
+        unsigned int count = 0;
+        struct dirent *de;
+        DIR *d = NULL;
+        FILE *f;
+        long tz_offset;
+        int r;
+
+        if (asprintf(&p, "%s/loader/entries", esp_path) < 0 ||
+            asprintf(&t, "%s/loader/entries.idx", esp_path) < 0) {
+                fprintf(stderr, "Out of memory.\n");
+                r = -ENOMEM;
+                goto finish;
+        }
+
+        d = opendir(p);
+        if (!d) {
+                if (errno == ENOENT) {
+                        unlink(t);
+                        r = 0;
+                        goto finish;
+                }
+
+                fprintf(stderr, "Failed to read %s: %m\n", p);
+                r = -errno;
+                goto finish;
+        }
+
+        r = index_append(&b, NULL, sizeof(struct entries_index_header));
+        if (r < 0)
+                goto finish;
+
+        tz_offset = fat_tz_offset(esp_path);
+
+        while ((de = readdir(d))) {
+                struct stat st;
+                char *content;
+                size_t n;
+
+                if (de->d_name[0] == '.')
+                        continue;
+
+                n = strlen(de->d_name);
+                if (n < 6 || strcasecmp(de->d_name + n - 5, ".conf") != 0)
+                        continue;
+
+                if (fstatat(dirfd(d), de->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode))
+                        continue;
+
+                free(q);
+                q = NULL;
+                if (asprintf(&q, "%s/%s", p, de->d_name) < 0) {
+                        fprintf(stderr, "Out of memory.\n");
+                        r = -ENOMEM;
+                        goto finish;
+                }
+
+                f = fopen(q, "re");
+                if (!f) {
+                        fprintf(stderr, "Failed to open %s for reading: %m\n", q);
+                        r = -errno;
+                        goto finish;
+                }
+
+                content = calloc(1, st.st_size + 1);
+                if (!content) {
+                        fclose(f);
+                        fprintf(stderr, "Out of memory.\n");
+                        r = -ENOMEM;
+                        goto finish;
+                }
+
+                if (fread(content, 1, st.st_size, f) != (size_t) st.st_size) {
+                        fprintf(stderr, "Failed to read %s.\n", q);
+                        free(content);
+                        fclose(f);
+                        r = -EIO;
+                        goto finish;
+                }
+                fclose(f);
+
+                r = index_append_entry(&b, de->d_name, content, &st, tz_offset);
+                free(content);
+                if (r < 0) {
+                        fprintf(stderr, "Out of memory.\n");
+                        goto finish;
+                }
+                count++;
+        }
+
+        h = (struct entries_index_header *)b.data;
+        memcpy(h->magic, "GUMMIIDX", 8);
+        h->version = 1;
+        h->entry_count = count;
+        h->size = b.size;
+
+        free(q);
+        q = NULL;
+        if (asprintf(&q, "%s.tmp", t) < 0) {
+                fprintf(stderr, "Out of memory.\n");
+                r = -ENOMEM;
+                goto finish;
+        }
+
+        f = fopen(q, "we");
+        if (!f) {
+                fprintf(stderr, "Failed to open %s for writing: %m\n", q);
+                r = -errno;
+                goto finish;
+        }
+
+        if (fwrite(b.data, 1, b.size, f) != b.size || fflush(f) != 0 || fsync(fileno(f)) < 0) {
+                fprintf(stderr, "Failed to write %s: %m\n", q);
+                fclose(f);
+                unlink(q);
+                r = -EIO;
+                goto finish;
+        }
+        fclose(f);
+
+        if (rename(q, t) < 0) {
+                fprintf(stderr, "Failed to rename %s to %s: %m\n", q, t);
+                unlink(q);
+                r = -errno;
+                goto finish;
+        }
+
+        fprintf(stderr, "Indexed %u entries in %s.\n", count, t);
+        r = 0;
+
+finish:
+        if (d)
+                closedir(d);
+        free(b.data);
+        free(p);
+        free(t);
+        free(q);
+        return r;
+}
+
 static int install_loader_config(const char *esp_path) {
         char *p = NULL;
         char line[64];
@@ -1257,7 +2055,11 @@ static int help(void) {
                "     status          Show status of installed Gummiboot and EFI variables\n"
                "     install         Install Gummiboot to the ESP and EFI variables\n"
                "     update          Update Gummiboot in the ESP and EFI variables\n"
-               "     remove          Remove Gummiboot from the ESP and EFI variables\n",
+               "     remove          Remove Gummiboot from the ESP and EFI variables\n"
+               "     index           Update the index of the boot entries in the ESP\n"
+               "     timing          Show the boot loader timestamps of the current boot\n"
+               "     blame           Show the boot loader trace ordered by time taken\n"
+               "     trace           Export the boot loader timeline as Chrome trace-event JSON\n",
                program_invocation_short_name);
 
         return 0;
@@ -1322,7 +2124,11 @@ int main(int argc, char*argv[]) {
                 ACTION_STATUS,
                 ACTION_INSTALL,
                 ACTION_UPDATE,
-                ACTION_REMOVE
+                ACTION_REMOVE,
+                ACTION_INDEX,
+                ACTION_TIMING,
+                ACTION_BLAME,
+                ACTION_TRACE
         } arg_action = ACTION_STATUS;
 
         static const struct {
@@ -1333,6 +2139,10 @@ int main(int argc, char*argv[]) {
                 { "install", ACTION_INSTALL },
                 { "update",  ACTION_UPDATE },
                 { "remove",  ACTION_REMOVE },
+                { "index",   ACTION_INDEX },
+                { "timing",  ACTION_TIMING },
+                { "blame",   ACTION_BLAME },
+                { "trace",   ACTION_TRACE },
         };
 
         uint8_t uuid[16] = "";
@@ -1360,6 +2170,16 @@ int main(int argc, char*argv[]) {
                 }
         }
 
+        /* reading the loader variables needs neither root nor the ESP */
+        if (arg_action == ACTION_TIMING || arg_action == ACTION_BLAME) {
+                r = status_timing(arg_action == ACTION_BLAME);
+                goto finish;
+        }
+        if (arg_action == ACTION_TRACE) {
+                r = status_trace_json();
+                goto finish;
+        }
+
         if (!arg_path)
                 arg_path = "/boot";
 
@@ -1396,11 +2216,19 @@ int main(int argc, char*argv[]) {
                 if (arg_action == ACTION_INSTALL)
                         install_loader_config(arg_path);
 
-                if (arg_touch_variables)
+                r = install_entries_index(arg_path);
+                if (r < 0)
+                        goto finish;
+
+                if (arg_touch_variables) {
                         r = install_variables(arg_path,
                                               part, pstart, psize, uuid,
                                               "/EFI/gummiboot/gummiboot" MACHINE_TYPE_NAME ".efi",
                                               arg_action == ACTION_INSTALL);
+
+                        /* make the boot loader look for the well-known loaders again */
+                        efi_set_variable(EFI_VENDOR_LOADER, "LoaderProbeCache", NULL, 0);
+                }
                 break;
 
         case ACTION_REMOVE:
@@ -1410,8 +2238,18 @@ int main(int argc, char*argv[]) {
                         q = remove_variables(uuid, "/EFI/gummiboot/gummiboot" MACHINE_TYPE_NAME ".efi", true);
                         if (q < 0 && r == 0)
                                 r = q;
+                        efi_set_variable(EFI_VENDOR_LOADER, "LoaderProbeCache", NULL, 0);
                 }
                 break;
+
+        case ACTION_INDEX:
+                r = install_entries_index(arg_path);
+                break;
+
+        case ACTION_TIMING:
+        case ACTION_BLAME:
+        case ACTION_TRACE:
+                break;
         }
 
 finish:
@@ -1,5 +1,7 @@
 #!/bin/bash -e
 
+MACHINE_TYPE_NAME=${MACHINE_TYPE_NAME:-x64}
+
 # create GPT table with EFI System Partition
 rm -f test-disk
 dd if=/dev/null of=test-disk bs=1M seek=64 count=1
@@ -13,9 +15,9 @@ mount $LOOP mnt
 
 # install gummiboot
 mkdir -p mnt/EFI/BOOT
-cp gummibootx64.efi mnt/EFI/BOOT/BOOTX64.EFI
+cp gummiboot$MACHINE_TYPE_NAME.efi mnt/EFI/BOOT/BOOT${MACHINE_TYPE_NAME^^}.EFI
 
-[ -e /boot/shellx64.efi ] && cp /boot/shellx64.efi mnt/
+[ -e /boot/shell$MACHINE_TYPE_NAME.efi ] && cp /boot/shell$MACHINE_TYPE_NAME.efi mnt/
 
 # install entries
 mkdir -p mnt/loader/entries
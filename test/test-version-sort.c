@@ -0,0 +1,184 @@
+/*
+ * Check that the version sort keys of the boot loader order entry file names
+ * like the str_verscmp() they replaced.
+ *
+ * The functions are taken from src/efi/gummiboot.c by "make test-version-sort".
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef uint16_t CHAR16;
+typedef uint32_t UINT32;
+typedef uintptr_t UINTN;
+typedef intptr_t INTN;
+typedef int BOOLEAN;
+
+typedef struct {
+        CHAR16 *file;
+} ConfigEntry;
+
+static INTN StrCmp(const CHAR16 *s1, const CHAR16 *s2) {
+        while (*s1 && *s1 == *s2) {
+                s1++;
+                s2++;
+        }
+        return (INTN)*s1 - (INTN)*s2;
+}
+
+#include "test-version-sort.inc"
+
+/* the comparison used before the sort keys */
+static INTN str_verscmp(CHAR16 *s1, CHAR16 *s2)
+{
+        CHAR16 *os1 = s1;
+        CHAR16 *os2 = s2;
+
+        while (*s1 || *s2) {
+                INTN first;
+
+                while ((*s1 && !is_digit(*s1)) || (*s2 && !is_digit(*s2))) {
+                        INTN order;
+
+                        order = c_order(*s1) - c_order(*s2);
+                        if (order)
+                                return order;
+                        s1++;
+                        s2++;
+                }
+
+                while (*s1 == '0')
+                        s1++;
+                while (*s2 == '0')
+                        s2++;
+
+                first = 0;
+                while (is_digit(*s1) && is_digit(*s2)) {
+                        if (first == 0)
+                                first = *s1 - *s2;
+                        s1++;
+                        s2++;
+                }
+
+                if (is_digit(*s1))
+                        return 1;
+                if (is_digit(*s2))
+                        return -1;
+
+                if (first)
+                        return first;
+        }
+
+        return StrCmp(os1, os2);
+}
+
+static const char *names[] = {
+        "",
+        "0",
+        "00",
+        "000",
+        "1",
+        "01",
+        "001",
+        "10",
+        "010",
+        "9",
+        "a",
+        "A",
+        "z",
+        "Z",
+        "a0",
+        "a00",
+        "a1",
+        "a01",
+        "a1a",
+        "a1b",
+        "ab1",
+        "1a",
+        "1a1",
+        "1.0",
+        "1.00",
+        "1.0.1",
+        "1.01",
+        "1.1",
+        "1-1",
+        "1~1",
+        "1_1",
+        "1~rc1",
+        "1-rc1",
+        "~",
+        "-",
+        ".",
+        "fedora",
+        "fedora-3.10.0",
+        "fedora-3.9.0",
+        "fedora-3.10.0-rc1",
+        "fedora-3.10.0~rc1",
+        "fedora-3.10.0.fc20.x86_64",
+        "fedora-3.10.10-200.fc19.x86_64",
+        "fedora-3.10.9-200.fc19.x86_64",
+        "fedora-3.10.09-200.fc19.x86_64",
+        "fedora-3.10.009-200.fc19.x86_64",
+        "fedora-3.11.0-0.rc1.git0.1.fc20.x86_64",
+        "fedora-3.11.0-0.rc1.git0.1.fc20.x86_64+debug",
+        "arch-linux",
+        "arch-linux-lts",
+        "vmlinuz-4.9.0-3-amd64",
+        "vmlinuz-4.9.0-12-amd64",
+        "vmlinuz-4.19.0-0.bpo.5-amd64",
+        "vmlinuz-4.19.0-0.bpo.10-amd64",
+        "6a6c3a3f4b6f4e4c9c5d1e8f2a0b7c11-5.4.0",
+        "6a6c3a3f4b6f4e4c9c5d1e8f2a0b7c11-5.10.0",
+        "6A6C3A3F4B6F4E4C9C5D1E8F2A0B7C11-5.10.0",
+        "linux99999999999999999999",
+        "linux100000000000000000000",
+        "linux0099999999999999999999",
+};
+
+#define ELEMENTSOF(x) (sizeof(x)/sizeof((x)[0]))
+#define NAME_LEN 64
+
+static int sign(INTN x) {
+        return (x > 0) - (x < 0);
+}
+
+int main(void) {
+        static CHAR16 str[ELEMENTSOF(names)][NAME_LEN];
+        static UINT32 keys[ELEMENTSOF(names)][NAME_LEN * 3];
+        static ConfigEntry entries[ELEMENTSOF(names)];
+        static SortItem items[ELEMENTSOF(names)];
+        unsigned int failed = 0;
+        UINTN i, k;
+
+        for (i = 0; i < ELEMENTSOF(names); i++) {
+                for (k = 0; names[i][k]; k++)
+                        str[i][k] = names[i][k];
+                str[i][k] = '\0';
+
+                entries[i].file = str[i];
+                items[i].entry = &entries[i];
+                items[i].key = keys[i];
+                items[i].key_len = version_key(str[i], keys[i]);
+        }
+
+        for (i = 0; i < ELEMENTSOF(names); i++)
+                for (k = 0; k < ELEMENTSOF(names); k++) {
+                        int old = sign(str_verscmp(str[i], str[k]));
+                        int new = sign(sort_item_cmp(&items[i], &items[k]));
+
+                        if (old == new)
+                                continue;
+                        fprintf(stderr, "\"%s\" <=> \"%s\": str_verscmp() %d, sort key %d\n",
+                                names[i], names[k], old, new);
+                        failed++;
+                }
+
+        if (failed > 0) {
+                fprintf(stderr, "%u of %zu comparisons differ\n", failed, ELEMENTSOF(names) * ELEMENTSOF(names));
+                return 1;
+        }
+
+        printf("%zu names, all comparisons agree\n", ELEMENTSOF(names));
+        return 0;
+}